@@ -0,0 +1,170 @@
+/*
+ * admission.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#if defined(__linux__)
+# include <linux/tcp.h>
+#endif /* __linux__ */
+
+#include <stdint.h>
+
+#include "admission.h"
+#include "core.h"
+#include "journal.h"
+
+/*
+ * Connections are shed as they are accepted, before any quote work, in
+ * two ways. A ceiling bounds how many connections are open at once,
+ * counting clients that are still being written to. And a controller
+ * modelled on CoDel watches how long connections sat in the kernel's
+ * accept queue. Once that has stayed above the target for a whole
+ * interval, connections are hung up on, more and more often, until the
+ * delay falls below the target again. Clients that are served are then
+ * served promptly, rather than everyone timing out together.
+ */
+
+static unsigned long max_connections;
+static unsigned long connections;
+static uint32_t target, interval;
+
+#if defined(__linux__) && defined(TCP_INFO)
+# define HAVE_SOJOURN			1
+#else
+# define HAVE_SOJOURN			0
+#endif /* __linux__ && TCP_INFO */
+
+void admission_init(const struct options *opt)
+{
+	max_connections = opt->max_connections;
+	target = opt->admission_target;
+	interval = opt->admission_interval;
+
+#if !HAVE_SOJOURN
+	if (target) {
+		journal("AdmissionTarget isn't supported here, ignoring it.\n");
+		target = 0;
+	}
+#endif /* !HAVE_SOJOURN */
+}
+
+/* How long the connection waited to be accepted, in milliseconds */
+static uint32_t sojourn_time(int consockfd)
+{
+#if HAVE_SOJOURN
+	struct tcp_info info;
+	socklen_t len;
+
+	/* The handshake's final ACK is the last thing a new connection received */
+	len = sizeof(info);
+	if (getsockopt(consockfd, IPPROTO_TCP, TCP_INFO, &info, &len))
+		return 0;
+	return info.tcpi_last_ack_recv;
+#else
+	UNUSED(consockfd);
+	return 0;
+#endif /* HAVE_SOJOURN */
+}
+
+static uint32_t isqrt(uint32_t n)
+{
+	uint32_t root, bit;
+
+	root = 0;
+	for (bit = UINT32_C(1) << 30; bit > n; bit >>= 2);
+	for (; bit; bit >>= 2) {
+		if (n >= root + bit) {
+			n -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+	}
+	return root;
+}
+
+/* Shedding speeds up with the square root of how many have been shed */
+static uint32_t control_law(const struct admission *a, uint32_t t)
+{
+	return t + interval / isqrt(MAX(a->count, 1));
+}
+
+static int codel_shed(struct admission *a, uint32_t sojourn, uint32_t now)
+{
+	int ok_to_drop;
+
+	if (sojourn < target) {
+		a->above = 0;
+		a->dropping = 0;
+		return 0;
+	}
+
+	if (!a->above) {
+		a->above = 1;
+		a->first_above = now + interval;
+		return 0;
+	}
+	ok_to_drop = TIME_AFTER_EQ(now, a->first_above);
+
+	if (a->dropping) {
+		if (!TIME_AFTER_EQ(now, a->drop_next))
+			return 0;
+		a->count++;
+		a->drop_next = control_law(a, a->drop_next);
+		return 1;
+	}
+	if (!ok_to_drop)
+		return 0;
+
+	/* Pick up where we left off, if we only stopped shedding recently */
+	a->dropping = 1;
+	if (a->count > a->last_count + 1 && !TIME_AFTER_EQ(now, a->drop_next + 16 * interval))
+		a->count -= a->last_count;
+	else
+		a->count = 1;
+	a->last_count = a->count;
+	a->drop_next = control_law(a, now);
+	return 1;
+}
+
+/*
+ * Whether to serve a connection that has just been accepted. If it is
+ * admitted, admission_release() must be called once it is closed.
+ */
+int admission_admit(struct admission *a, int consockfd, uint32_t now)
+{
+	if (target && codel_shed(a, sojourn_time(consockfd), now))
+		return 0;
+
+	if (max_connections) {
+		if (ATOMIC_ADD(connections, 1) > max_connections) {
+			ATOMIC_SUB(connections, 1);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void admission_release(void)
+{
+	if (max_connections)
+		ATOMIC_SUB(connections, 1);
+}
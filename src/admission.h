@@ -0,0 +1,42 @@
+/*
+ * admission.h
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <stdint.h>
+
+#include "config.h"
+
+/* Each thread that accepts connections keeps its own controller */
+struct admission {
+	uint32_t first_above;			/* when the delay will have been high for an interval */
+	uint32_t drop_next;			/* when the next connection is shed */
+	uint32_t count;				/* how many have been shed since dropping began */
+	uint32_t last_count;			/* the count when dropping last stopped */
+	unsigned above    : 1;			/* whether the delay is over the target */
+	unsigned dropping : 1;			/* whether connections are being shed */
+};
+
+void admission_init(const struct options *opt);
+int admission_admit(struct admission *a, int consockfd, uint32_t now);
+void admission_release(void);
+
+#endif /* _ADMISSION_H_ */
@@ -20,6 +20,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <arpa/inet.h>
 #include <libgen.h>
 #include <limits.h>
 #include <unistd.h>
@@ -35,6 +36,7 @@
 #include "core.h"
 #include "daemon.h"
 #include "journal.h"
+#include "quotes.h"
 
 #define BOOLEAN_UNSET		2u
 
@@ -74,6 +76,19 @@ static const char *name_option_protocol(enum transport_protocol tproto, enum int
 		default:
 			return "UDP ???";
 		}
+	case PROTOCOL_TBOTH:
+		switch (iproto) {
+		case PROTOCOL_IPv4:
+			return "TCP and UDP IPv4 only";
+		case PROTOCOL_IPv6:
+			return "TCP and UDP IPv6 only";
+		case PROTOCOL_BOTH:
+			return "TCP and UDP IPv4 and IPv6";
+		case PROTOCOL_INONE:
+			return "TCP and UDP <UNSET>";
+		default:
+			return "TCP and UDP ???";
+		}
 	case PROTOCOL_TNONE:
 		switch (iproto) {
 		case PROTOCOL_IPv4:
@@ -119,8 +134,9 @@ struct argument_flags {
 	const char *journal_file;
 	enum transport_protocol tproto;
 	enum internet_protocol iproto;
-	unsigned daemonize : 2;
-	unsigned strict    : 1;
+	unsigned daemonize   : 2;
+	unsigned strict      : 1;
+	unsigned build_index : 1;
 };
 
 static const char *default_pidfile(void)
@@ -163,7 +179,10 @@ static void help_and_exit(const char *program_name)
 	      "  -t, --tcp             Use TCP. This is the default behavior.\n"
 	      "  -u, --udp             Use UDP instead of TCP. (Not fully implemented yet)\n"
 	      "  -q, --quiet           Only output error messages. This is the essentially the same as\n"
-	      "                        using \"--journal /dev/null\".\n"
+	      "                        using \"--journal /dev/null\".\n",
+	      stdout);
+	fputs("      --build-index     Write an index of the quotes file so that the daemon can load it\n"
+	      "                        without parsing, then exit.\n"
 	      "  --help                List all options and what they do.\n"
 	      "  --version             Print the version and some basic license information.\n",
 	      stdout);
@@ -182,6 +201,14 @@ static void version_and_exit()
 	cleanup(EXIT_SUCCESS, 0);
 }
 
+static void build_index_and_exit(const struct options *opt)
+{
+	open_journal(opt->journal_file);
+	if (build_quotes_index(opt))
+		cleanup(EXIT_IO, 1);
+	cleanup(EXIT_SUCCESS, 1);
+}
+
 static void parse_short_options(const char *argument,
 				const char *next_arg,
 				int *index,
@@ -369,6 +396,8 @@ static void parse_long_option(const char *argument,
 		flags->tproto = PROTOCOL_UDP;
 	} else if (!strcmp(argument, "quiet")) {
 		close_journal();
+	} else if (!strcmp(argument, "build-index")) {
+		flags->build_index = 1;
 	} else {
 		printf("Unrecognized long option: \"--%s\".\n", argument);
 		usage_and_exit(flags->program_name);
@@ -380,6 +409,10 @@ void parse_args(struct options *const opt,
 		const char *const argv[])
 {
 	struct argument_flags flags;
+#if DEBUG
+	char host[INET6_ADDRSTRLEN];
+	unsigned int j;
+#endif /* DEBUG */
 	int i;
 
 	/* Set override flags */
@@ -393,6 +426,7 @@ void parse_args(struct options *const opt,
 	flags.iproto = PROTOCOL_INONE;
 	flags.daemonize = BOOLEAN_UNSET;
 	flags.strict = 1;
+	flags.build_index = 0;
 
 	/* Set default options, defined in options.h */
 	opt->port = DEFAULT_PORT;
@@ -408,6 +442,36 @@ void parse_args(struct options *const opt,
 	opt->pad_quotes = DEFAULT_PAD_QUOTES;
 	opt->allow_big = DEFAULT_ALLOW_BIG;
 	opt->chdir_root = DEFAULT_CHDIR_ROOT;
+	opt->map_quotes = DEFAULT_MAP_QUOTES;
+	opt->index_file = DEFAULT_INDEX_FILE;
+	opt->use_index = DEFAULT_USE_INDEX;
+	opt->verify_index = DEFAULT_VERIFY_INDEX;
+	opt->parser_threads = DEFAULT_PARSER_THREADS;
+	opt->workers = DEFAULT_WORKERS;
+	opt->pin_workers = DEFAULT_PIN_WORKERS;
+	opt->steer_by_cpu = DEFAULT_STEER_BY_CPU;
+	opt->separate_listeners = DEFAULT_SEPARATE_LISTENERS;
+	opt->accept_mode = DEFAULT_ACCEPT_MODE;
+	opt->tcp_backend = DEFAULT_TCP_BACKEND;
+	opt->listen_count = 0;
+	opt->unix_stream_path = DEFAULT_UNIX_STREAM_PATH;
+	opt->unix_dgram_path = DEFAULT_UNIX_DGRAM_PATH;
+	opt->unix_socket_mode = DEFAULT_UNIX_SOCKET_MODE;
+	opt->rate_limit = DEFAULT_RATE_LIMIT;
+	opt->rate_limit_burst = DEFAULT_RATE_LIMIT_BURST;
+	opt->rate_limit_prefix4 = DEFAULT_RATE_LIMIT_PREFIX4;
+	opt->rate_limit_prefix6 = DEFAULT_RATE_LIMIT_PREFIX6;
+	opt->max_connections = DEFAULT_MAX_CONNECTIONS;
+	opt->admission_target = DEFAULT_ADMISSION_TARGET;
+	opt->admission_interval = DEFAULT_ADMISSION_INTERVAL;
+	opt->write_timeout = DEFAULT_WRITE_TIMEOUT;
+	opt->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	opt->sendfile_threshold = DEFAULT_SENDFILE_THRESHOLD;
+	opt->zerocopy_threshold = DEFAULT_ZEROCOPY_THRESHOLD;
+	opt->low_latency = DEFAULT_LOW_LATENCY;
+	opt->busy_poll = DEFAULT_BUSY_POLL;
+	opt->huge_pages = DEFAULT_HUGE_PAGES;
+	opt->realtime_priority = DEFAULT_REALTIME_PRIORITY;
 
 	/* Parse arguments */
 	for (i = 1; i < argc; i++) {
@@ -461,13 +525,53 @@ void parse_args(struct options *const opt,
 	journal("	PidFile: %s\n",			opt->pid_file);
 	journal("	Port: %u\n",			opt->port);
 	journal("	QuoteDivider: %s\n",		name_option_quote_divider(opt->linediv));
+	journal("	ParserThreads: %u\n",		opt->parser_threads);
 	journal("	Protocol: %s\n",		name_option_protocol(opt->tproto, opt->iproto));
+	journal("	Workers: %u\n",			opt->workers);
+	journal("	PinWorkers: %s\n",		BOOLSTR(opt->pin_workers));
+	journal("	SteerByCpu: %s\n",		BOOLSTR(opt->steer_by_cpu));
+	journal("	SeparateListeners: %s\n",	BOOLSTR(opt->separate_listeners));
+	journal("	AcceptMode: %s\n",		(opt->accept_mode == ACCEPT_STEALING) ? "stealing" : "reuseport");
+	journal("	TcpBackend: %s\n",		(opt->tcp_backend == BACKEND_IO_URING) ? "io_uring" : "epoll");
+	for (j = 0; j < opt->listen_count; j++) {
+		const struct listen_address *listen = &opt->listen[j];
+		const int v6 = (listen->iproto == PROTOCOL_IPv6);
+
+		inet_ntop(v6 ? AF_INET6 : AF_INET, listen->addr, host, sizeof(host));
+		journal("	Listen: %s%s%s:%u/%s\n",
+			v6 ? "[" : "", host, v6 ? "]" : "", listen->port,
+			(listen->tproto == PROTOCOL_UDP) ? "udp" : "tcp");
+	}
+	journal("	UnixStreamSocket: %s\n",	DEFAULT(opt->unix_stream_path, "(none)"));
+	journal("	UnixDatagramSocket: %s\n",	DEFAULT(opt->unix_dgram_path, "(none)"));
+	journal("	UnixSocketMode: %03o\n",	opt->unix_socket_mode);
+	journal("	RateLimit: %u\n",		opt->rate_limit);
+	journal("	RateLimitBurst: %u\n",		opt->rate_limit_burst);
+	journal("	RateLimitIPv4Prefix: %u\n",	opt->rate_limit_prefix4);
+	journal("	RateLimitIPv6Prefix: %u\n",	opt->rate_limit_prefix6);
+	journal("	MaxConnections: %u\n",		opt->max_connections);
+	journal("	AdmissionTarget: %u\n",		opt->admission_target);
+	journal("	AdmissionInterval: %u\n",	opt->admission_interval);
+	journal("	WriteTimeout: %u\n",		opt->write_timeout);
+	journal("	IdleTimeout: %u\n",		opt->idle_timeout);
+	journal("	SendfileThreshold: %u\n",	opt->sendfile_threshold);
+	journal("	ZeroCopyThreshold: %u\n",	opt->zerocopy_threshold);
+	journal("	LowLatency: %s\n",		BOOLSTR(opt->low_latency));
+	journal("	BusyPoll: %u\n",		opt->busy_poll);
+	journal("	HugePages: %s\n",		BOOLSTR(opt->huge_pages));
+	journal("	RealtimePriority: %u\n",	opt->realtime_priority);
 	journal("	Daemonize: %s\n",		BOOLSTR(opt->daemonize));
 	journal("	RequirePidfile: %s\n",	  	BOOLSTR(opt->require_pidfile));
 	journal("	DropPrivileges: %s\n",	  	BOOLSTR(opt->drop_privileges));
 	journal("	DailyQuotes: %s\n",	  	BOOLSTR(opt->is_daily));
 	journal("	AllowBigQuotes: %s\n",	  	BOOLSTR(opt->allow_big));
 	journal("	ChdirRoot: %s\n",		BOOLSTR(opt->chdir_root));
+	journal("	MapQuotesFile: %s\n",	  	BOOLSTR(opt->map_quotes));
+	journal("	QuotesIndexFile: %s\n",	opt->use_index ? DEFAULT(opt->index_file, "(default)") : "none");
+	journal("	VerifyQuotesIndex: %s\n",	BOOLSTR(opt->verify_index));
 	journal("}\n\n");
 #endif /* DEBUG */
+
+	if (flags.build_index)
+		build_index_and_exit(opt);
 }
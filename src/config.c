@@ -18,6 +18,8 @@
  * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <arpa/inet.h>
+#include <sys/un.h>
 #include <limits.h>
 #include <strings.h>
 #include <unistd.h>
@@ -34,6 +36,7 @@
 #include "security.h"
 
 #define PORT_MAX		65535    /* Not in limits.h */
+#define COUNT_MAX		65535
 #define BUFFER_SIZE		PATH_MAX
 
 #define NOT_BOOL(x)		((x) != (!!(x)))
@@ -228,6 +231,129 @@ static int get_port(const struct string *s,
 	return port;
 }
 
+static int get_count(const struct string *s,
+		     const char *filename,
+		     unsigned int lineno)
+{
+	size_t i;
+	int count;
+
+	count = 0;
+	for (i = 0; i < s->length; i++) {
+		if (unlikely(!isdigit(s->ptr[i]) || count > COUNT_MAX / 10))
+			goto invalid;
+
+		count *= 10;
+		count += (s->ptr[i]) - '0';
+	}
+	if (unlikely(i == 0 || count > COUNT_MAX))
+		goto invalid;
+	return count;
+
+invalid:
+	fprintf(stderr, "%s:%u: invalid count: ",
+		filename, lineno);
+	print_str(stderr, s);
+	return -1;
+}
+
+static int get_mode(const struct string *s,
+		    const char *filename,
+		    unsigned int lineno)
+{
+	size_t i;
+	int mode;
+
+	mode = 0;
+	for (i = 0; i < s->length; i++) {
+		if (unlikely(s->ptr[i] < '0' || s->ptr[i] > '7' || mode > 0777 / 8))
+			goto invalid;
+
+		mode *= 8;
+		mode += (s->ptr[i]) - '0';
+	}
+	if (unlikely(i == 0))
+		goto invalid;
+	return mode;
+
+invalid:
+	fprintf(stderr, "%s:%u: invalid octal file mode: ",
+		filename, lineno);
+	print_str(stderr, s);
+	return -1;
+}
+
+/* Parses "<address>:<port>/<protocol>", with IPv6 addresses in brackets */
+static int get_listen_address(const struct string *s,
+			      const char *filename,
+			      unsigned int lineno,
+			      struct listen_address *listen)
+{
+	char host[64];
+	struct string part;
+	const char *colon, *slash;
+	size_t i;
+	int port;
+
+	colon = slash = NULL;
+	for (i = 0; i < s->length; i++) {
+		if (s->ptr[i] == ':')
+			colon = &s->ptr[i];
+		else if (s->ptr[i] == '/')
+			slash = &s->ptr[i];
+	}
+	if (!colon || !slash || slash < colon)
+		goto invalid;
+
+	/* Protocol */
+	part.ptr = slash + 1;
+	part.length = s->ptr + s->length - part.ptr;
+	if (caseless_eq(&part, "tcp", 3))
+		listen->tproto = PROTOCOL_TCP;
+	else if (caseless_eq(&part, "udp", 3))
+		listen->tproto = PROTOCOL_UDP;
+	else
+		goto invalid;
+
+	/* Port */
+	part.ptr = colon + 1;
+	part.length = slash - part.ptr;
+	for (i = 0; i < part.length; i++) {
+		if (!isdigit(part.ptr[i]))
+			goto invalid;
+	}
+	port = get_port(&part, filename, lineno);
+	if (port < 0)
+		return -1;
+	listen->port = port;
+
+	/* Address */
+	part.ptr = s->ptr;
+	part.length = colon - part.ptr;
+	if (part.length >= 2 && part.ptr[0] == '[' && part.ptr[part.length - 1] == ']') {
+		listen->iproto = PROTOCOL_IPv6;
+		part.ptr++;
+		part.length -= 2;
+	} else {
+		listen->iproto = PROTOCOL_IPv4;
+	}
+	if (part.length == 0 || part.length >= sizeof(host))
+		goto invalid;
+
+	memcpy(host, part.ptr, part.length);
+	host[part.length] = '\0';
+	if (inet_pton((listen->iproto == PROTOCOL_IPv6) ? AF_INET6 : AF_INET,
+		      host, listen->addr) != 1)
+		goto invalid;
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s:%u: listen address not in the form \"address:port/protocol\": ",
+		filename, lineno);
+	print_str(stderr, s);
+	return -1;
+}
+
 static int process_line(struct options *opt,
 			const char *conf_file,
 			unsigned int lineno,
@@ -257,6 +383,8 @@ static int process_line(struct options *opt,
 			opt->tproto = PROTOCOL_TCP;
 		} else if (caseless_eq(&val, "udp", 3)) {
 			opt->tproto = PROTOCOL_UDP;
+		} else if (caseless_eq(&val, "both", 4)) {
+			opt->tproto = PROTOCOL_TBOTH;
 		} else {
 			fprintf(stderr, "%s:%d: invalid transport protocol: ",
 				conf_file, lineno);
@@ -276,6 +404,40 @@ static int process_line(struct options *opt,
 			print_str(stderr, &val);
 			return -1;
 		}
+	} else if (caseless_eq(&key, "Listen", 6)) {
+		if (unlikely(opt->listen_count == MAX_LISTENERS)) {
+			fprintf(stderr, "%s:%u: at most %d listen addresses are supported.\n",
+				conf_file, lineno, MAX_LISTENERS);
+			return -1;
+		}
+		if (get_listen_address(&val, conf_file, lineno, &opt->listen[opt->listen_count]))
+			return -1;
+		opt->listen_count++;
+	} else if (caseless_eq(&key, "UnixStreamSocket", 16)) {
+		opt->unix_stream_path = NULL;
+		if (caseless_eq(&val, "none", 4))
+			return 0;
+
+		opt->unix_stream_path = dup_str(&val);
+		if (unlikely(!opt->unix_stream_path)) {
+			perror("Unable to allocate memory for config value");
+			cleanup(EXIT_MEMORY, 1);
+		}
+	} else if (caseless_eq(&key, "UnixDatagramSocket", 18)) {
+		opt->unix_dgram_path = NULL;
+		if (caseless_eq(&val, "none", 4))
+			return 0;
+
+		opt->unix_dgram_path = dup_str(&val);
+		if (unlikely(!opt->unix_dgram_path)) {
+			perror("Unable to allocate memory for config value");
+			cleanup(EXIT_MEMORY, 1);
+		}
+	} else if (caseless_eq(&key, "UnixSocketMode", 14)) {
+		n = get_mode(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->unix_socket_mode = n;
 	} else if (caseless_eq(&key, "Port", 4)) {
 		n = get_port(&val, conf_file, lineno);
 		if (unlikely(n < 0))
@@ -323,6 +485,23 @@ static int process_line(struct options *opt,
 			perror("Unable to allocate memory for config value");
 			cleanup(EXIT_MEMORY, 1);
 		}
+	} else if (caseless_eq(&key, "QuotesIndexFile", 15)) {
+		if (caseless_eq(&val, "none", 4)) {
+			opt->use_index = 0;
+			return 0;
+		}
+
+		opt->use_index = 1;
+		opt->index_file = dup_str(&val);
+		if (unlikely(!opt->index_file)) {
+			perror("Unable to allocate memory for config value");
+			cleanup(EXIT_MEMORY, 1);
+		}
+	} else if (caseless_eq(&key, "VerifyQuotesIndex", 17)) {
+		n = str_to_bool(&val, conf_file, lineno);
+		if (unlikely(NOT_BOOL(n)))
+			return -1;
+		opt->verify_index = n;
 	} else if (caseless_eq(&key, "QuoteDivider", 12)) {
 		if (caseless_eq(&val, "line", 4)) {
 			opt->linediv = DIV_EVERYLINE;
@@ -336,6 +515,153 @@ static int process_line(struct options *opt,
 			print_str(stderr, &val);
 			return -1;
 		}
+	} else if (caseless_eq(&key, "ParserThreads", 13)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->parser_threads = n;
+	} else if (caseless_eq(&key, "Workers", 7)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		if (unlikely(n > MAX_WORKERS)) {
+			fprintf(stderr, "%s:%u: at most %d workers are supported.\n",
+				conf_file, lineno, MAX_WORKERS);
+			return -1;
+		}
+		opt->workers = n;
+	} else if (caseless_eq(&key, "AcceptMode", 10)) {
+		if (caseless_eq(&val, "reuseport", 9)) {
+			opt->accept_mode = ACCEPT_REUSEPORT;
+		} else if (caseless_eq(&val, "stealing", 8)) {
+			opt->accept_mode = ACCEPT_STEALING;
+		} else {
+			fprintf(stderr, "%s:%u: unsupported accept mode: ",
+				conf_file, lineno);
+			print_str(stderr, &val);
+			return -1;
+		}
+	} else if (caseless_eq(&key, "TcpBackend", 10)) {
+		if (caseless_eq(&val, "epoll", 5)) {
+			opt->tcp_backend = BACKEND_EPOLL;
+		} else if (caseless_eq(&val, "io_uring", 8)) {
+			opt->tcp_backend = BACKEND_IO_URING;
+		} else {
+			fprintf(stderr, "%s:%u: unsupported TCP backend: ",
+				conf_file, lineno);
+			print_str(stderr, &val);
+			return -1;
+		}
+	} else if (caseless_eq(&key, "PinWorkers", 10)) {
+		n = str_to_bool(&val, conf_file, lineno);
+		if (unlikely(NOT_BOOL(n)))
+			return -1;
+		opt->pin_workers = n;
+	} else if (caseless_eq(&key, "SteerByCpu", 10)) {
+		n = str_to_bool(&val, conf_file, lineno);
+		if (unlikely(NOT_BOOL(n)))
+			return -1;
+		opt->steer_by_cpu = n;
+	} else if (caseless_eq(&key, "SeparateListeners", 17)) {
+		n = str_to_bool(&val, conf_file, lineno);
+		if (unlikely(NOT_BOOL(n)))
+			return -1;
+		opt->separate_listeners = n;
+	} else if (caseless_eq(&key, "RateLimit", 9)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->rate_limit = n;
+	} else if (caseless_eq(&key, "RateLimitBurst", 14)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->rate_limit_burst = n;
+	} else if (caseless_eq(&key, "RateLimitIPv4Prefix", 19)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		if (unlikely(n > 32)) {
+			fprintf(stderr, "%s:%u: an IPv4 prefix is at most 32 bits.\n",
+				conf_file, lineno);
+			return -1;
+		}
+		opt->rate_limit_prefix4 = n;
+	} else if (caseless_eq(&key, "RateLimitIPv6Prefix", 19)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		if (unlikely(n > 128)) {
+			fprintf(stderr, "%s:%u: an IPv6 prefix is at most 128 bits.\n",
+				conf_file, lineno);
+			return -1;
+		}
+		opt->rate_limit_prefix6 = n;
+	} else if (caseless_eq(&key, "MaxConnections", 14)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->max_connections = n;
+	} else if (caseless_eq(&key, "AdmissionTarget", 15)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->admission_target = n;
+	} else if (caseless_eq(&key, "AdmissionInterval", 17)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		if (unlikely(n == 0)) {
+			fprintf(stderr, "%s:%u: the admission interval can't be zero.\n",
+				conf_file, lineno);
+			return -1;
+		}
+		opt->admission_interval = n;
+	} else if (caseless_eq(&key, "WriteTimeout", 12)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->write_timeout = n;
+	} else if (caseless_eq(&key, "IdleTimeout", 11)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->idle_timeout = n;
+	} else if (caseless_eq(&key, "SendfileThreshold", 17)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->sendfile_threshold = n;
+	} else if (caseless_eq(&key, "ZeroCopyThreshold", 17)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->zerocopy_threshold = n;
+	} else if (caseless_eq(&key, "LowLatency", 10)) {
+		n = str_to_bool(&val, conf_file, lineno);
+		if (unlikely(NOT_BOOL(n)))
+			return -1;
+		opt->low_latency = n;
+	} else if (caseless_eq(&key, "BusyPoll", 8)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		opt->busy_poll = n;
+	} else if (caseless_eq(&key, "HugePages", 9)) {
+		n = str_to_bool(&val, conf_file, lineno);
+		if (unlikely(NOT_BOOL(n)))
+			return -1;
+		opt->huge_pages = n;
+	} else if (caseless_eq(&key, "RealtimePriority", 16)) {
+		n = get_count(&val, conf_file, lineno);
+		if (unlikely(n < 0))
+			return -1;
+		if (unlikely(n > 99)) {
+			fprintf(stderr, "%s:%u: a real-time priority is at most 99.\n",
+				conf_file, lineno);
+			return -1;
+		}
+		opt->realtime_priority = n;
 	} else if (caseless_eq(&key, "PadQuotes", 9)) {
 		n = str_to_bool(&val, conf_file, lineno);
 		if (unlikely(NOT_BOOL(n)))
@@ -351,6 +677,11 @@ static int process_line(struct options *opt,
 		if (unlikely(NOT_BOOL(n)))
 			return -1;
 		opt->allow_big = n;
+	} else if (caseless_eq(&key, "MapQuotesFile", 13)) {
+		n = str_to_bool(&val, conf_file, lineno);
+		if (unlikely(NOT_BOOL(n)))
+			return -1;
+		opt->map_quotes = n;
 	} else {
 		fprintf(stderr, "%s:%u: unknown config option: ",
 			conf_file, lineno);
@@ -400,27 +731,49 @@ void parse_config(struct options *opt, const char *conf_file)
 	}
 }
 
-void check_config(const struct options *const opt)
+static void check_unix_path(const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (!path)
+		return;
+	if (path[0] != '/') {
+		fprintf(stderr, "Unix socket '%s' is not an absolute path.\n", path);
+		cleanup(EXIT_ARGUMENTS, 1);
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Unix socket '%s' is too long a path.\n", path);
+		cleanup(EXIT_ARGUMENTS, 1);
+	}
+}
+
+static void check_port(unsigned int port)
 {
-	if (opt->port < MIN_NORMAL_PORT && geteuid() != ROOT_USER_ID) {
+	if (port < MIN_NORMAL_PORT && geteuid() != ROOT_USER_ID) {
 		fprintf(stderr, "Only root can bind to ports below %d.\n",
 			MIN_NORMAL_PORT);
 		cleanup(EXIT_ARGUMENTS, 1);
 	}
+}
+
+void check_config(const struct options *const opt)
+{
+	unsigned int i;
+
+	/* Port is only used if there are no Listen options */
+	if (!opt->listen_count)
+		check_port(opt->port);
+	for (i = 0; i < opt->listen_count; i++)
+		check_port(opt->listen[i].port);
 	if (opt->pid_file && opt->pid_file[0] != '/') {
 		fprintf(stderr, "Specified pid file is not an absolute path.\n");
 		cleanup(EXIT_ARGUMENTS, 1);
 	}
+	check_unix_path(opt->unix_stream_path);
+	check_unix_path(opt->unix_dgram_path);
 	if (access(opt->quotes_file, R_OK)) {
 		fprintf(stderr, "Unable to access quotes file '%s': %s.\n",
 			opt->quotes_file, strerror(errno));
 		cleanup(EXIT_IO, 1);
 	}
-
-	/* See issue #10 */
-	if ((opt->iproto == PROTOCOL_IPv6 || opt->iproto == PROTOCOL_BOTH) &&
-	     opt->tproto == PROTOCOL_UDP) {
-		fprintf(stderr, "UDP over IPv6 doesn't work yet. Sorry.\n");
-		cleanup(EXIT_UNSUPPORTED, 1);
-	}
 }
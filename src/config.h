@@ -30,9 +30,20 @@ enum quote_divider {
 enum transport_protocol {
 	PROTOCOL_TCP,
 	PROTOCOL_UDP,
+	PROTOCOL_TBOTH,
 	PROTOCOL_TNONE
 };
 
+enum accept_mode {
+	ACCEPT_REUSEPORT,
+	ACCEPT_STEALING
+};
+
+enum tcp_backend {
+	BACKEND_EPOLL,
+	BACKEND_IO_URING
+};
+
 enum internet_protocol {
 	PROTOCOL_IPv4,
 	PROTOCOL_IPv6,
@@ -53,16 +64,79 @@ enum internet_protocol {
 # define DEFAULT_PAD_QUOTES		1
 # define DEFAULT_IS_DAILY		1
 # define DEFAULT_ALLOW_BIG		0
+# define DEFAULT_MAP_QUOTES		1
+# define DEFAULT_INDEX_FILE		NULL /* means "quotes file + .idx" */
+# define DEFAULT_USE_INDEX		1
+# define DEFAULT_VERIFY_INDEX		0
+# define DEFAULT_PARSER_THREADS		0 /* means "one per CPU" */
+# define DEFAULT_WORKERS		1
+# define DEFAULT_PIN_WORKERS		0
+# define DEFAULT_STEER_BY_CPU		0
+# define DEFAULT_ACCEPT_MODE		ACCEPT_REUSEPORT
+# define DEFAULT_TCP_BACKEND		BACKEND_EPOLL
+# define DEFAULT_SEPARATE_LISTENERS	0
+# define DEFAULT_LOW_LATENCY		0
+# define DEFAULT_HUGE_PAGES		0
+# define DEFAULT_RATE_LIMIT		0 /* means "no limit" */
+# define DEFAULT_RATE_LIMIT_BURST	0 /* means "same as the rate" */
+# define DEFAULT_RATE_LIMIT_PREFIX4	24
+# define DEFAULT_RATE_LIMIT_PREFIX6	56
+# define DEFAULT_MAX_CONNECTIONS	0 /* means "no limit" */
+# define DEFAULT_ADMISSION_TARGET	0 /* means "don't shed" */
+# define DEFAULT_ADMISSION_INTERVAL	100
+# define DEFAULT_WRITE_TIMEOUT		30
+# define DEFAULT_IDLE_TIMEOUT		10
+# define DEFAULT_SENDFILE_THRESHOLD	64 /* in KiB, 0 means "never" */
+# define DEFAULT_ZEROCOPY_THRESHOLD	0  /* in KiB, 0 means "never" */
 # define DEFAULT_CHDIR_ROOT		1
+# define DEFAULT_UNIX_STREAM_PATH	NULL
+# define DEFAULT_UNIX_DGRAM_PATH	NULL
+# define DEFAULT_UNIX_SOCKET_MODE	0666
+# define DEFAULT_BUSY_POLL		50 /* in microseconds, 0 means "don't" */
+# define DEFAULT_REALTIME_PRIORITY	0  /* means "normal scheduling" */
+
+# define MAX_WORKERS			256
+# define MAX_LISTENERS			16
+
+/* An address from a Listen option */
+struct listen_address {
+	enum internet_protocol iproto;		/* PROTOCOL_IPv4 or PROTOCOL_IPv6 */
+	enum transport_protocol tproto;		/* PROTOCOL_TCP or PROTOCOL_UDP */
+	unsigned char addr[16];			/* the address, in network byte order */
+	unsigned int port;
+};
 
 struct options {
 	const char *quotes_file;		/* string containing path to quotes file */
 	const char *pid_file;			/* string containing path to pid file */
 	const char *journal_file;		/* string containing path to journal file */
+	const char *index_file;			/* string containing path to quotes index, or NULL for the default */
 	unsigned int port;			/* what port to listen on */
+	unsigned int parser_threads;		/* how many threads parse the quotes file, 0 for one per CPU */
+	unsigned int workers;			/* how many threads serve requests, 0 for one per CPU */
 	enum quote_divider linediv;	 	/* how to read the quotes file */
 	enum transport_protocol tproto; 	/* which transport protocol to use */
 	enum internet_protocol iproto;  	/* which internet protocol to use */
+	enum accept_mode accept_mode;		/* how TCP connections are spread across workers */
+	enum tcp_backend tcp_backend;		/* how workers wait for and answer TCP clients */
+	struct listen_address listen[MAX_LISTENERS];	/* addresses to listen on, instead of the above */
+	unsigned int listen_count;		/* how many Listen options were given */
+	const char *unix_stream_path;		/* path of the Unix stream socket, or NULL for none */
+	const char *unix_dgram_path;		/* path of the Unix datagram socket, or NULL for none */
+	unsigned int unix_socket_mode;		/* permissions given to the Unix sockets */
+	unsigned int rate_limit;		/* requests per second from each source prefix, 0 for no limit */
+	unsigned int rate_limit_burst;		/* how many requests a quiet prefix may send at once */
+	unsigned int rate_limit_prefix4;	/* how many bits of an IPv4 address make up its prefix */
+	unsigned int rate_limit_prefix6;	/* how many bits of an IPv6 address make up its prefix */
+	unsigned int max_connections;		/* how many TCP clients may be open at once, 0 for no limit */
+	unsigned int admission_target;		/* accept queue delay in ms to shed above, 0 for none */
+	unsigned int admission_interval;	/* how long in ms the delay must stay high before shedding */
+	unsigned int write_timeout;		/* seconds a TCP client has to read its quote, 0 for forever */
+	unsigned int idle_timeout;		/* seconds a TCP client may go without reading, 0 for forever */
+	unsigned int sendfile_threshold;	/* KiB from which quotes are sent from the file, 0 for never */
+	unsigned int zerocopy_threshold;	/* KiB from which responses are sent with MSG_ZEROCOPY, 0 for never */
+	unsigned int busy_poll;			/* microseconds to busy poll listeners with LowLatency, 0 for never */
+	unsigned int realtime_priority;		/* SCHED_FIFO priority of workers with LowLatency, 0 for none */
 
 	unsigned daemonize		: 1;	/* whether to fork to the background or not */
 	unsigned require_pidfile	: 1;	/* whether to quit if the pidfile cannot be made */
@@ -72,6 +146,14 @@ struct options {
 	unsigned pad_quotes		: 1;	/* whether to pad the quote with newlines */
 	unsigned allow_big		: 1;	/* ignore 512-byte limit */
 	unsigned chdir_root		: 1;	/* whether to chdir to / when running */
+	unsigned map_quotes		: 1;	/* whether to mmap() the quotes file instead of reading it */
+	unsigned use_index		: 1;	/* whether to look for a prebuilt quotes index */
+	unsigned verify_index		: 1;	/* whether to checksum the quotes file against its index */
+	unsigned pin_workers		: 1;	/* whether to bind each worker thread to its own CPU */
+	unsigned steer_by_cpu		: 1;	/* whether clients go to the worker on the CPU they arrived on */
+	unsigned separate_listeners	: 1;	/* whether IPv4 and IPv6 get their own sockets and workers */
+	unsigned low_latency		: 1;	/* whether to trade memory and CPU for steadier response times */
+	unsigned huge_pages		: 1;	/* whether to back quote buffers with huge pages in LowLatency mode */
 };
 
 void parse_config(struct options *opt, const char *conf_file);
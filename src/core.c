@@ -18,7 +18,11 @@
  * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/time.h>
+
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "core.h"
 
@@ -43,3 +47,19 @@ void print_version(void)
 	       __TIME__,
 	       PROGRAM_NAME);
 }
+
+/* Milliseconds on a clock that only goes forward, wrapping around */
+uint32_t clock_ms(void)
+{
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint32_t)((uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000);
+#endif /* CLOCK_MONOTONIC */
+}
@@ -21,6 +21,8 @@
 #ifndef _CORE_H_
 #define _CORE_H_
 
+#include <stdint.h>
+
 /* Definitions */
 
 #define PROGRAM_NAME				"qotd"
@@ -97,6 +99,8 @@
 #define PLURAL(x)				(((x) == 1) ? "" : "s")
 #define EMPTYSTR(x)				(((x)[0]) == '\0')
 
+#define CACHE_LINE_SIZE				64
+
 #define MIN(x,y)				(((x) < (y)) ? (x) : (y))
 #define MAX(x,y)				(((x) > (y)) ? (x) : (y))
 
@@ -119,14 +123,33 @@
 # define likely(x)				__builtin_expect(!!(x), 1)
 # define unlikely(x)				__builtin_expect(!!(x), 0)
 # define NORETURN				__attribute__((noreturn))
+# define ATOMIC_LOAD(x)				__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+# define ATOMIC_STORE(x,v)			__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+# define ATOMIC_ADD(x,v)			__atomic_add_fetch(&(x), (v), __ATOMIC_ACQ_REL)
+# define ATOMIC_SUB(x,v)			__atomic_sub_fetch(&(x), (v), __ATOMIC_ACQ_REL)
+# define ATOMIC_CAS(x,e,d)			__atomic_compare_exchange_n(&(x), &(e), (d), 0, \
+							    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+# define ATOMIC_FENCE()				__atomic_thread_fence(__ATOMIC_SEQ_CST)
+# define THREAD_LOCAL				__thread
 #else
 # define likely(x)				(x)
 # define unlikely(x)				(x)
 # define NORETURN
+# define ATOMIC_LOAD(x)				(x)
+# define ATOMIC_STORE(x,v)			((x) = (v))
+# define ATOMIC_ADD(x,v)			((x) += (v))
+# define ATOMIC_SUB(x,v)			((x) -= (v))
+# define ATOMIC_CAS(x,e,d)			(((x) == (e)) ? ((x) = (d), 1) : ((e) = (x), 0))
+# define ATOMIC_FENCE()				((void)0)
+# define THREAD_LOCAL
 #endif /* __GNUC__ || __clang__ */
 
+/* Times from clock_ms() wrap around, so they are compared by their difference */
+#define TIME_AFTER_EQ(a,b)			((int32_t)((uint32_t)(a) - (uint32_t)(b)) >= 0)
+
 /* Functions */
 
 void print_version(void);
+uint32_t clock_ms(void);
 
 #endif /* _CORE_H_ */
@@ -25,14 +25,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "admission.h"
 #include "arguments.h"
 #include "config.h"
 #include "core.h"
 #include "daemon.h"
 #include "journal.h"
+#include "latency.h"
 #include "network.h"
 #include "pid_file.h"
 #include "quotes.h"
+#include "ratelimit.h"
 #include "security.h"
 #include "signal_hndl.h"
 
@@ -43,7 +46,10 @@ static void load_config(const int argc,
 {
 	parse_args(&opt, argc, argv);
 	check_config(&opt);
+}
 
+static void load_quotes(void)
+{
 	if (open_quotes_file(&opt)) {
 		journal("Unable to open quotes file: %s.\n", strerror(errno));
 		cleanup(EXIT_IO, 1);
@@ -55,6 +61,9 @@ static int main_loop(void)
 	void (*accept_connection)(void);
 
 	pidfile_create(&opt);
+	if (ratelimit_init(&opt))
+		cleanup(EXIT_MEMORY, 1);
+	admission_init(&opt);
 
 	switch (opt.iproto) {
 	case PROTOCOL_BOTH:
@@ -70,11 +79,18 @@ static int main_loop(void)
 		cleanup(EXIT_INTERNAL, 1);
 	}
 
+	/* The workers inherit the main thread's scheduling */
+	latency_set_realtime(1);
 	if (opt.drop_privileges)
 		drop_privileges();
+	if (start_quotes_timer() || start_workers())
+		cleanup(EXIT_FAILURE, 1);
+	latency_lock_memory();
 
 	switch (opt.tproto) {
 	case PROTOCOL_TCP:
+	case PROTOCOL_TBOTH:
+		/* The TCP event loop answers UDP too */
 		accept_connection = tcp_accept_connection;
 		break;
 	case PROTOCOL_UDP:
@@ -88,8 +104,10 @@ static int main_loop(void)
 		return -1;
 	}
 
-	for (;;)
+	for (;;) {
+		check_reload();
 		accept_connection();
+	}
 }
 
 static int daemonize(void)
@@ -127,6 +145,8 @@ int main(const int argc, const char *const argv[])
 	signal_hndl_init();
 	load_config(argc, argv);
 	open_journal(opt.journal_file);
+	latency_init(&opt);
+	load_quotes();
 
 	/* Check security settings */
 	if (opt.strict)
@@ -0,0 +1,75 @@
+/*
+ * fd_queue.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "core.h"
+#include "fd_queue.h"
+
+#define SLOT(queue,i)			((queue)->fds[(i) & (FD_QUEUE_SIZE - 1)])
+
+void fd_queue_init(struct fd_queue *queue)
+{
+	memset(queue, 0, sizeof(*queue));
+}
+
+/* Only the producer may call this. Returns -1 if the queue is full. */
+int fd_queue_push(struct fd_queue *queue, int fd)
+{
+	unsigned long head, tail;
+
+	tail = queue->tail;
+	head = ATOMIC_LOAD(queue->head);
+	if (tail - head >= FD_QUEUE_SIZE)
+		return -1;
+
+	ATOMIC_STORE(SLOT(queue, tail), fd);
+	ATOMIC_STORE(queue->tail, tail + 1);
+	return 0;
+}
+
+/*
+ * Any thread may call this. Returns -1 if the queue is empty.
+ *
+ * The slot is read before the head is claimed. If another consumer gets
+ * there first, the producer may already be reusing the slot, but then
+ * the claim fails and the value is thrown away.
+ */
+int fd_queue_take(struct fd_queue *queue)
+{
+	unsigned long head, tail;
+	int fd;
+
+	head = ATOMIC_LOAD(queue->head);
+	for (;;) {
+		tail = ATOMIC_LOAD(queue->tail);
+		if (head >= tail)
+			return -1;
+
+		fd = ATOMIC_LOAD(SLOT(queue, head));
+		if (ATOMIC_CAS(queue->head, head, head + 1))
+			return fd;
+	}
+}
+
+int fd_queue_empty(struct fd_queue *queue)
+{
+	return ATOMIC_LOAD(queue->head) >= ATOMIC_LOAD(queue->tail);
+}
@@ -0,0 +1,47 @@
+/*
+ * fd_queue.h
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FD_QUEUE_H_
+#define _FD_QUEUE_H_
+
+#include "core.h"
+
+/* Must be a power of two */
+#define FD_QUEUE_SIZE			4096
+
+/*
+ * A bounded queue of file descriptors with one producer and any number
+ * of consumers, none of which take locks. The head and tail are on
+ * separate cache lines since different threads move them.
+ */
+struct fd_queue {
+	unsigned long head;
+	char pad1[CACHE_LINE_SIZE - sizeof(unsigned long)];
+	unsigned long tail;
+	char pad2[CACHE_LINE_SIZE - sizeof(unsigned long)];
+	int fds[FD_QUEUE_SIZE];
+};
+
+void fd_queue_init(struct fd_queue *queue);
+int fd_queue_push(struct fd_queue *queue, int fd);
+int fd_queue_take(struct fd_queue *queue);
+int fd_queue_empty(struct fd_queue *queue);
+
+#endif /* _FD_QUEUE_H_ */
@@ -0,0 +1,184 @@
+/*
+ * latency.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#if defined(__linux__)
+# define _GNU_SOURCE
+# define HAVE_LATENCY			1
+#else
+# define HAVE_LATENCY			0
+#endif /* __linux__ */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core.h"
+#include "journal.h"
+#include "latency.h"
+
+/* Transparent huge pages are this big on most machines */
+#define HUGE_PAGE_SIZE			(2 * 1024 * 1024)
+
+#if HAVE_LATENCY && defined(MADV_HUGEPAGE)
+# define HAVE_HUGE_PAGES		1
+#else
+# define HAVE_HUGE_PAGES		0
+#endif /* HAVE_LATENCY && MADV_HUGEPAGE */
+
+/* Unset until latency_init(), as when building an index, means "off" */
+static const struct options *opt;
+
+#define LOW_LATENCY()			(opt && opt->low_latency)
+
+#if HAVE_LATENCY
+static void raise_limit(int resource, rlim_t value)
+{
+	struct rlimit lim;
+
+	if (getrlimit(resource, &lim))
+		return;
+	if (lim.rlim_max < value) {
+		lim.rlim_cur = value;
+		lim.rlim_max = value;
+		if (!setrlimit(resource, &lim))
+			return;
+		getrlimit(resource, &lim);
+	}
+
+	/* Without the privilege to lift the limit, go as far as it allows */
+	lim.rlim_cur = MIN(value, lim.rlim_max);
+	setrlimit(resource, &lim);
+}
+#endif /* HAVE_LATENCY */
+
+void latency_init(const struct options *const options)
+{
+	opt = options;
+	if (!LOW_LATENCY())
+		return;
+
+#if HAVE_LATENCY
+	raise_limit(RLIMIT_MEMLOCK, RLIM_INFINITY);
+
+	/* So the main thread can go back to real time after a reload */
+	if (opt->realtime_priority)
+		raise_limit(RLIMIT_RTPRIO, opt->realtime_priority);
+#else
+	journal("LowLatency isn't supported here, ignoring it.\n");
+#endif /* HAVE_LATENCY */
+	if (opt->huge_pages && !HAVE_HUGE_PAGES)
+		journal("HugePages isn't supported here, ignoring it.\n");
+}
+
+/*
+ * Called once the quotes are loaded and the workers are running, so
+ * everything they touch is already mapped. Later allocations, like the
+ * buffers for reloaded quotes, are only locked as they are made if there
+ * is no limit on locked memory; otherwise they would start failing once
+ * it was reached.
+ */
+void latency_lock_memory(void)
+{
+#if HAVE_LATENCY
+	struct rlimit lim;
+	int flags;
+
+	if (!LOW_LATENCY())
+		return;
+
+	flags = MCL_CURRENT;
+	if (!getrlimit(RLIMIT_MEMLOCK, &lim) && lim.rlim_cur == RLIM_INFINITY)
+		flags |= MCL_FUTURE;
+	if (mlockall(flags))
+		journal("Unable to lock the daemon in memory: %s.\n", strerror(errno));
+#endif /* HAVE_LATENCY */
+}
+
+/*
+ * The main thread turns RealtimePriority on while it still has the
+ * privileges to, and the workers it starts inherit it. It turns it off
+ * again while it reloads the quotes, and so do threads that only do
+ * background work, like the daily quote timer.
+ */
+void latency_set_realtime(int on)
+{
+#if HAVE_LATENCY
+	struct sched_param param;
+	int ret;
+
+	if (!LOW_LATENCY() || !opt->realtime_priority)
+		return;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = on ? (int)opt->realtime_priority : 0;
+	ret = pthread_setschedparam(pthread_self(),
+				    on ? SCHED_FIFO : SCHED_OTHER,
+				    &param);
+	if (ret)
+		journal("Unable to change thread scheduling: %s.\n", strerror(ret));
+#else
+	UNUSED(on);
+#endif /* HAVE_LATENCY */
+}
+
+/* Extra mmap() flags for read-only file mappings */
+int latency_map_flags(void)
+{
+#if HAVE_LATENCY && defined(MAP_POPULATE)
+	if (LOW_LATENCY())
+		return MAP_POPULATE;
+#endif /* HAVE_LATENCY && MAP_POPULATE */
+	return 0;
+}
+
+/*
+ * Allocates a buffer that quotes are served from. With HugePages, large
+ * ones are aligned to and advised onto huge pages, so a worker touching
+ * them takes fewer TLB misses. Either way the result is given to free().
+ */
+void *latency_alloc(size_t size)
+{
+#if HAVE_HUGE_PAGES
+	void *ptr;
+	size_t rounded;
+	int ret;
+
+	if (!LOW_LATENCY() || !opt->huge_pages || size < HUGE_PAGE_SIZE)
+		return malloc(size);
+
+	rounded = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	ret = posix_memalign(&ptr, HUGE_PAGE_SIZE, rounded);
+	if (ret) {
+		errno = ret;
+		return NULL;
+	}
+	if (madvise(ptr, rounded, MADV_HUGEPAGE))
+		journal("Unable to use huge pages for quotes: %s.\n", strerror(errno));
+	return ptr;
+#else
+	return malloc(size);
+#endif /* HAVE_HUGE_PAGES */
+}
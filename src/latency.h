@@ -0,0 +1,39 @@
+/*
+ * latency.h
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stddef.h>
+
+#include "config.h"
+
+/*
+ * Everything here is a no-op unless LowLatency is set. latency_init() and
+ * latency_set_realtime(1) have to run before privileges are dropped.
+ */
+void latency_init(const struct options *opt);
+void latency_lock_memory(void);
+void latency_set_realtime(int on);
+int latency_map_flags(void);
+void *latency_alloc(size_t size);
+
+#endif /* _LATENCY_H_ */
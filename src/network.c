@@ -18,39 +18,235 @@
  * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#if defined(__linux__)
+# define _GNU_SOURCE
+# define HAVE_EPOLL			1
+# define HAVE_MMSG			1
+#else
+# define HAVE_EPOLL			0
+# define HAVE_MMSG			0
+#endif /* __linux__ */
+
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <ifaddrs.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 
+#if HAVE_EPOLL
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+# include <sys/resource.h>
+# include <sys/sendfile.h>
+# include <linux/errqueue.h>
+# include <linux/filter.h>
+# include <fcntl.h>
+# include <sched.h>
+#endif /* HAVE_EPOLL */
+
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "admission.h"
 #include "core.h"
 #include "daemon.h"
+#include "fd_queue.h"
 #include "journal.h"
 #include "network.h"
 #include "quotes.h"
+#include "ratelimit.h"
+#include "timer_wheel.h"
+#include "uring.h"
 
 #define IPPROTO_PART_STRING(opt)	(((opt)->iproto == PROTOCOL_BOTH) ? "4/" : "")
-#define TCP_CONNECTION_BACKLOG		50
+#define TPROTO_STRING(opt)		(((opt)->tproto == PROTOCOL_TBOTH) ? "TCP and UDP" : \
+					 ((opt)->tproto == PROTOCOL_TCP) ? "TCP" : "UDP")
+#define SERVES_TCP(opt)			((opt)->tproto != PROTOCOL_UDP)
+#define SERVES_UDP(opt)			((opt)->tproto != PROTOCOL_TCP)
+#define TCP_CONNECTION_BACKLOG		4096
+#define EPOLL_BATCH			64
+#define ACCEPT_BATCH			64
+#define UDP_BATCH_MAX			64
+#define ZEROCOPY_CHUNK			(256 * 1024)
+#define ADDRESS_STRLEN			(INET6_ADDRSTRLEN + 16)
+#define MAX_SOCKETS			(MAX_LISTENERS + 2)	/* and the two Unix sockets */
+
+/* Unix clients that haven't bound a name have nowhere for an answer to go */
+#define HAS_NAME(len)			((len) > offsetof(struct sockaddr_un, sun_path))
 
 #if !defined(MSG_NOSIGNAL)
 # define MSG_NOSIGNAL			0
 #endif /* MSG_NOSIGNAL */
 
-static int sockfd = -1;
+#if HAVE_EPOLL && defined(SO_REUSEPORT)
+# define HAVE_REUSEPORT			1
+#else
+# define HAVE_REUSEPORT			0
+#endif /* HAVE_EPOLL && SO_REUSEPORT */
+
+#if HAVE_EPOLL && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+# define HAVE_ZEROCOPY			1
+#else
+# define HAVE_ZEROCOPY			0
+# undef MSG_ZEROCOPY
+# define MSG_ZEROCOPY			0
+#endif /* HAVE_EPOLL && SO_ZEROCOPY */
+
+#if HAVE_EPOLL && defined(SO_BUSY_POLL)
+# define HAVE_BUSY_POLL			1
+#else
+# define HAVE_BUSY_POLL			0
+#endif /* HAVE_EPOLL && SO_BUSY_POLL */
+
+#if HAVE_REUSEPORT && defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SO_INCOMING_CPU)
+# define HAVE_STEERING			1
+#else
+# define HAVE_STEERING			0
+#endif /* HAVE_REUSEPORT && SO_ATTACH_REUSEPORT_CBPF */
+
+/*
+ * Each worker has its own listening socket, bound to the same port with
+ * SO_REUSEPORT, so the kernel spreads clients across them. The main
+ * thread is always worker 0.
+ *
+ * With AcceptMode set to stealing, only worker 0 listens. It accepts
+ * connections and hands them out in turn to the queues of the other
+ * workers, which take connections from each other's queues when their
+ * own is empty.
+ *
+ * With TcpBackend set to io_uring, each worker in reuseport mode makes
+ * its own ring, and serves its socket from that instead of epoll.
+ *
+ * A worker can have several sockets, one for each listener its set of
+ * workers serves, which are all answered from the same event loop.
+ * Unix sockets can't share a path with SO_REUSEPORT, so each is bound
+ * once and shared by the workers of the first set.
+ */
+struct worker {
+	int socks[MAX_SOCKETS];		/* one per listener, or -1 if it serves another set */
+	unsigned int sock_count;
+	int sockfd;			/* its only socket, if it has just one */
+	int socktype;
+
+#if HAVE_EPOLL
+	int epollfd;
+	int spare_fd;
+
+	struct fd_queue *queue;
+	int wakefd;
+	unsigned int idle;
+
+	struct admission admission;
+	struct timer_wheel timers;	/* deadlines for its slow clients */
+	uint32_t now;
+#endif /* HAVE_EPOLL */
+
+#if HAVE_MMSG
+	unsigned int udp_batch;
+#endif /* HAVE_MMSG */
+
+	struct uring *ring;
+	unsigned int id;
+	pthread_t thread;
+};
+
+#if HAVE_EPOLL
+/* Sends made with MSG_ZEROCOPY, which the kernel tells us when it's done with */
+struct zerocopy {
+	uint32_t sent;
+	uint32_t done;
+	unsigned on	: 1;	/* whether large sends still use it */
+};
+
+/*
+ * A client whose quote didn't fit in the socket buffer, or that was sent
+ * some of it with MSG_ZEROCOPY. It holds on to the quotes it is being
+ * sent, in case they are reloaded before the client has read them, or
+ * before the kernel is done sending them out of our memory.
+ */
+struct tcp_client {
+	struct timer timer;		/* must be first */
+	uint32_t deadline;		/* when it must have read everything */
+	int fd;
+	struct quote_span left;		/* what hasn't been sent yet */
+	struct quote_data *quotes;
+	struct zerocopy zc;
+};
+
+static cpu_set_t allowed_cpus;
+#endif /* HAVE_EPOLL */
+
+/*
+ * Something to listen on. Without any Listen options, these come from
+ * InternetProtocol, TransportProtocol and Port. When IPv4 and IPv6 have
+ * separate listeners, each is served by its own set of workers. The
+ * Unix sockets come after them.
+ */
+struct listener {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int type;
+	int v6only;
+	unsigned int set;
+	int shared_fd;			/* a Unix socket, once it is made, or -1 */
+};
+
+static const struct options *opt;
+static struct worker workers[MAX_WORKERS];
+static struct listener listeners[MAX_SOCKETS];
+static unsigned int worker_count, listener_count, set_count, set_size;
+static int stealing, use_uring;
+static uint32_t write_timeout, idle_timeout;	/* in milliseconds, 0 for none */
+static size_t zerocopy_min;			/* bytes from which to use MSG_ZEROCOPY, 0 for never */
+
+/* Writes "address:port" into buf, which holds ADDRESS_STRLEN bytes */
+static void format_address(const struct sockaddr_storage *addr, char *buf)
+{
+	char host[INET6_ADDRSTRLEN];
+	const void *ip;
+	unsigned int port;
+	int v6;
+
+	if (addr->ss_family == AF_UNIX) {
+		strcpy(buf, "a Unix socket");
+		return;
+	}
+
+	v6 = (addr->ss_family == AF_INET6);
+	if (v6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+		ip = &sin6->sin6_addr;
+		port = ntohs(sin6->sin6_port);
+	} else {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+		ip = &sin->sin_addr;
+		port = ntohs(sin->sin_port);
+	}
+
+	if (!inet_ntop(addr->ss_family, ip, host, sizeof(host)))
+		strcpy(host, "(unknown)");
+	sprintf(buf, v6 ? "[%s]:%u" : "%s:%u", host, port);
+}
 
 #if DEBUG
-static void log_client(const struct sockaddr_in *cli_addr)
+static void log_client(const struct sockaddr_storage *cli_addr)
 {
-	journal("Received a query from %s:%d.\n",
-		inet_ntoa(cli_addr->sin_addr),
-		ntohs(cli_addr->sin_port));
+	char name[ADDRESS_STRLEN];
+
+	format_address(cli_addr, name);
+	journal("Received a query from %s.\n", name);
 }
 #endif /* DEBUG */
 
@@ -91,27 +287,90 @@ static void check_socket_error(const int error)
 	}
 }
 
-void set_up_ipv4_socket(const struct options *const opt)
+#if HAVE_EPOLL
+/* Every open connection takes a descriptor, so allow as many as we can */
+static void raise_fd_limit(void)
 {
-	struct sockaddr_in serv_addr;
-	const int one = 1;
+	struct rlimit rlim;
 
-	if (opt->tproto == PROTOCOL_TCP) {
-		journal("Setting up IPv4 socket over TCP...\n");
-		sockfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	} else {
-		journal("Setting up IPv4 socket over UDP...\n");
-		sockfd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (getrlimit(RLIMIT_NOFILE, &rlim) ||
+	    rlim.rlim_max == RLIM_INFINITY ||
+	    rlim.rlim_cur >= rlim.rlim_max)
+		return;
+
+	rlim.rlim_cur = rlim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rlim))
+		journal("Unable to raise the open file limit: %s.\n", strerror(errno));
+}
+
+static void watch_socket(struct worker *w, int sockfd, void *ptr, unsigned int events)
+{
+	struct epoll_event event;
+	int flags;
+
+	flags = fcntl(sockfd, F_GETFL);
+	if (unlikely(flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		const int errsave = errno;
+		JTRACE();
+		journal("Unable to make the socket non-blocking: %s.\n", strerror(errsave));
+		cleanup(EXIT_IO, 1);
 	}
 
-	if (unlikely(sockfd < 0)) {
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | events;
+	event.data.ptr = ptr;
+	if (unlikely(epoll_ctl(w->epollfd, EPOLL_CTL_ADD, sockfd, &event) < 0)) {
+		const int errsave = errno;
+		JTRACE();
+		journal("Unable to watch the socket: %s.\n", strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+}
+
+static void set_up_event_loop(struct worker *w)
+{
+	unsigned int k;
+
+	w->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(w->epollfd < 0)) {
+		const int errsave = errno;
+		JTRACE();
+		journal("Unable to create epoll instance: %s.\n", strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+
+	/*
+	 * Events for a listener point at the worker's socket for it. Only
+	 * one of the workers sharing a Unix socket is woken for each client.
+	 */
+	for (k = 0; k < listener_count; k++) {
+		if (w->socks[k] >= 0)
+			watch_socket(w, w->socks[k], &w->socks[k],
+				     (listeners[k].addr.ss_family == AF_UNIX) ? EPOLLEXCLUSIVE : 0);
+	}
+
+	/* Held in reserve for shedding connections when we run out of descriptors */
+	w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	timer_wheel_init(&w->timers, clock_ms());
+}
+#endif /* HAVE_EPOLL */
+
+/* TCP sockets listen once, for the lifetime of the daemon */
+static void tcp_listen(int sockfd)
+{
+	if (unlikely(listen(sockfd, TCP_CONNECTION_BACKLOG))) {
 		const int errsave = errno;
 		assert(errno != 0);
 		JTRACE();
-		journal("Unable to create IPv4 socket: %s.\n",
-			strerror(errsave));
+		journal("Unable to listen on socket: %s.\n", strerror(errsave));
 		cleanup(EXIT_IO, 1);
 	}
+}
+
+static void set_reuse_options(int sockfd)
+{
+	const int one = 1;
+
 	if (unlikely(setsockopt(sockfd,
 				SOL_SOCKET,
 				SO_REUSEADDR,
@@ -124,213 +383,1619 @@ void set_up_ipv4_socket(const struct options *const opt)
 			strerror(errsave));
 	}
 
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = INADDR_ANY;
-	serv_addr.sin_port = htons(opt->port);
-
-	if (unlikely(bind(sockfd,
-			 (const struct sockaddr *)(&serv_addr),
-			 sizeof(struct sockaddr_in)) < 0)) {
+#if HAVE_REUSEPORT
+	if (set_size > 1 &&
+	    unlikely(setsockopt(sockfd,
+				SOL_SOCKET,
+				SO_REUSEPORT,
+				(const void *)(&one),
+				sizeof(one)) < 0)) {
 		const int errsave = errno;
 		assert(errno != 0);
 		JTRACE();
-		journal("Unable to bind to IPv4 socket: %s.\n",
+		journal("Unable to set the socket to allow port reuse: %s.\n",
 			strerror(errsave));
 		cleanup(EXIT_IO, 1);
 	}
+#endif /* HAVE_REUSEPORT */
 }
 
-void set_up_ipv6_socket(const struct options *const opt)
+/*
+ * Whether something is still listening on the socket at a Unix path,
+ * such as another instance started with the same configuration.
+ */
+static int unix_socket_in_use(const struct listener *l)
 {
-	const unsigned char one = 1;
-	struct sockaddr_in6 serv_addr;
+	int probe, ret;
 
-	if (opt->tproto == PROTOCOL_TCP) {
-		journal("Setting up IPv%s6 socket over TCP...\n",
-			IPPROTO_PART_STRING(opt));
-		sockfd = socket(PF_INET6, SOCK_STREAM, IPPROTO_TCP);
-	} else {
-		journal("Setting up IPv%s6 socket over UDP...\n",
-			IPPROTO_PART_STRING(opt));
-		sockfd = socket(PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
-	}
+	probe = socket(AF_UNIX, l->type, 0);
+	if (unlikely(probe < 0))
+		return 0;
+	ret = connect(probe, (const struct sockaddr *)(&l->addr), l->addr_len);
+	close(probe);
+	return ret == 0;
+}
+
+/*
+ * A Unix socket replaces a stale socket left at its path, but not a live
+ * one or anything else, and is given UnixSocketMode once it is bound.
+ */
+static int make_unix_socket(const struct listener *l)
+{
+	const struct sockaddr_un *un = (const struct sockaddr_un *)&l->addr;
+	struct stat st;
+	int sockfd;
 
-	if (sockfd < 0) {
+	sockfd = socket(AF_UNIX, l->type, 0);
+	if (unlikely(sockfd < 0)) {
 		const int errsave = errno;
 		assert(errno != 0);
-		journal("Unable to create IPv6 socket: %s.\n", strerror(errsave));
+		JTRACE();
+		journal("Unable to create Unix socket: %s.\n", strerror(errsave));
 		cleanup(EXIT_IO, 1);
 	}
 
-	if (opt->iproto == PROTOCOL_IPv6) {
-		if (unlikely(setsockopt(sockfd,
-					IPPROTO_IPV6,
-					IPV6_V6ONLY,
-					(const void *)(&one),
-					sizeof(one)) < 0)) {
-			const int errsave = errno;
-			assert(errno != 0);
-			JTRACE();
-			journal("Unable to set IPv4 compatibility option: %s.\n", strerror(errsave));
+	if (!lstat(un->sun_path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			journal("Unable to bind to Unix socket %s: something else is there.\n",
+				un->sun_path);
+			cleanup(EXIT_IO, 1);
+		}
+		if (unix_socket_in_use(l)) {
+			journal("Unable to bind to Unix socket %s: %s.\n",
+				un->sun_path, strerror(EADDRINUSE));
 			cleanup(EXIT_IO, 1);
 		}
+		unlink(un->sun_path);
 	}
-	if (unlikely(setsockopt(sockfd,
-				SOL_SOCKET,
-				SO_REUSEADDR,
-				(const void *)(&one),
-				sizeof(one)) < 0)) {
+
+	if (unlikely(bind(sockfd,
+			  (const struct sockaddr *)(&l->addr),
+			  l->addr_len) < 0)) {
 		const int errsave = errno;
 		assert(errno != 0);
 		JTRACE();
-		journal("Unable to set the socket to allow address reuse: %s.\n", strerror(errsave));
+		journal("Unable to bind to Unix socket %s: %s.\n",
+			un->sun_path, strerror(errsave));
+		cleanup(EXIT_IO, 1);
 	}
 
-	serv_addr.sin6_family = AF_INET6;
-	serv_addr.sin6_addr = in6addr_any;
-	serv_addr.sin6_port = htons(opt->port);
-	serv_addr.sin6_flowinfo = htonl(0);
-	serv_addr.sin6_scope_id = 0;
+	if (unlikely(chmod(un->sun_path, opt->unix_socket_mode) < 0)) {
+		const int errsave = errno;
+		JTRACE();
+		journal("Unable to set the permissions of Unix socket %s: %s.\n",
+			un->sun_path, strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+	return sockfd;
+}
 
-	if (unlikely(bind(sockfd,
-			  (const struct sockaddr *)(&serv_addr),
-			  sizeof(struct sockaddr_in6)) < 0)) {
+/*
+ * In LowLatency mode, receives on the listeners and the connections
+ * accepted from them spin on the device queue for up to BusyPoll
+ * microseconds before sleeping. Raising it past net.core.busy_read
+ * needs the privileges the daemon has at this point.
+ */
+static void set_busy_poll(int sockfd)
+{
+#if HAVE_BUSY_POLL
+	const int usecs = opt->busy_poll;
+
+	if (!opt->low_latency || !usecs)
+		return;
+
+	if (unlikely(setsockopt(sockfd,
+				SOL_SOCKET,
+				SO_BUSY_POLL,
+				(const void *)(&usecs),
+				sizeof(usecs)) < 0)) {
 		const int errsave = errno;
 		assert(errno != 0);
-		journal("Unable to bind to socket: %s.\n",
+		JTRACE();
+		journal("Unable to set the socket to busy poll: %s.\n",
 			strerror(errsave));
-		cleanup(EXIT_IO, 1);
 	}
+#else
+	UNUSED(sockfd);
+#endif /* HAVE_BUSY_POLL */
 }
 
-void close_socket(void)
+static int make_socket(const struct listener *l)
 {
-	if (sockfd < 0)
-		return;
-	if (unlikely(close(sockfd))) {
+	char name[ADDRESS_STRLEN];
+	const char *family;
+	int sockfd;
+
+	if (l->addr.ss_family == AF_UNIX)
+		return make_unix_socket(l);
+
+	family = (l->addr.ss_family == AF_INET6) ? "IPv6" : "IPv4";
+	sockfd = socket(l->addr.ss_family, l->type,
+			(l->type == SOCK_STREAM) ? IPPROTO_TCP : IPPROTO_UDP);
+	if (unlikely(sockfd < 0)) {
+		const int errsave = errno;
+		assert(errno != 0);
+		JTRACE();
+		journal("Unable to create %s socket: %s.\n",
+			family, strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+
+	if (l->addr.ss_family == AF_INET6 &&
+	    unlikely(setsockopt(sockfd,
+				IPPROTO_IPV6,
+				IPV6_V6ONLY,
+				(const void *)(&l->v6only),
+				sizeof(l->v6only)) < 0)) {
+		const int errsave = errno;
+		assert(errno != 0);
+		JTRACE();
+		journal("Unable to set IPv4 compatibility option: %s.\n", strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+	set_reuse_options(sockfd);
+	set_busy_poll(sockfd);
+
+	if (unlikely(bind(sockfd,
+			  (const struct sockaddr *)(&l->addr),
+			  l->addr_len) < 0)) {
 		const int errsave = errno;
 		assert(errno != 0);
-		journal("Unable to close socket file descriptor %d: %s.\n",
-			sockfd, strerror(errsave));
+		JTRACE();
+		format_address(&l->addr, name);
+		journal("Unable to bind to %s socket %s: %s.\n",
+			family, name, strerror(errsave));
+		cleanup(EXIT_IO, 1);
 	}
+	return sockfd;
 }
 
-static void tcp_write(const char *buf,
-		      size_t *len,
-		      int consockfd)
+/* A NULL address means any address */
+static void add_listener(int family,
+			 const void *addr,
+			 unsigned int port,
+			 int type,
+			 int v6only,
+			 unsigned int set)
 {
-	while (*len > 0) {
-		ssize_t bytes;
+	struct listener *l;
 
-		bytes = send(consockfd, buf, *len, MSG_NOSIGNAL);
-		if (unlikely(bytes < 0)) {
-			const int errsave = errno;
-			JTRACE();
-			journal("Unable to write to TCP socket: %s.\n",
-				strerror(errsave));
-			check_socket_error(errsave);
-			return;
-		}
-		buf += bytes;
-		*len -= (size_t)bytes;
+	l = &listeners[listener_count++];
+	memset(l, 0, sizeof(*l));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&l->addr;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		if (addr)
+			memcpy(&sin6->sin6_addr, addr, sizeof(sin6->sin6_addr));
+		else
+			sin6->sin6_addr = in6addr_any;
+		l->addr_len = sizeof(struct sockaddr_in6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&l->addr;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		if (addr)
+			memcpy(&sin->sin_addr, addr, sizeof(sin->sin_addr));
+		else
+			sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		l->addr_len = sizeof(struct sockaddr_in);
 	}
+	l->type = type;
+	l->v6only = v6only;
+	l->set = set;
+	l->shared_fd = -1;
 }
 
-static void udp_write(const char *buf,
-		      size_t *len,
-		      const struct sockaddr *cli_addr,
-		      socklen_t cli_len)
+/* Unix sockets are served by the first set of workers */
+static void add_unix_listener(const char *path, int type)
 {
-	while (*len > 0) {
-		ssize_t bytes;
+	struct sockaddr_un *un;
+	struct listener *l;
 
-		bytes = sendto(sockfd, buf, *len, 0, cli_addr, cli_len);
-		if (unlikely(bytes < 0)) {
-			const int errsave = errno;
-			JTRACE();
-			journal("Unable to write to UDP socket: %s.\n",
-				strerror(errsave));
-			check_socket_error(errsave);
-			return;
-		}
-		buf += bytes;
-		*len -= (size_t)bytes;
+	l = &listeners[listener_count++];
+	memset(l, 0, sizeof(*l));
+	un = (struct sockaddr_un *)&l->addr;
+	un->sun_family = AF_UNIX;
+	strcpy(un->sun_path, path);
+	l->addr_len = sizeof(struct sockaddr_un);
+	l->type = type;
+	l->set = 0;
+	l->shared_fd = -1;
+
+	journal("Listening on Unix socket %s for %s.\n", path,
+		(type == SOCK_STREAM) ? "streams" : "datagrams");
+}
+
+static void add_default_listeners(int family, int v6only, unsigned int set)
+{
+	if (SERVES_UDP(opt))
+		add_listener(family, NULL, opt->port, SOCK_DGRAM, v6only, set);
+	if (SERVES_TCP(opt))
+		add_listener(family, NULL, opt->port, SOCK_STREAM, v6only, set);
+}
+
+static void add_configured_listeners(void)
+{
+	char name[ADDRESS_STRLEN];
+	unsigned int i;
+
+	for (i = 0; i < opt->listen_count; i++) {
+		const struct listen_address *listen = &opt->listen[i];
+
+		add_listener((listen->iproto == PROTOCOL_IPv6) ? AF_INET6 : AF_INET,
+			     listen->addr,
+			     listen->port,
+			     (listen->tproto == PROTOCOL_UDP) ? SOCK_DGRAM : SOCK_STREAM,
+			     1, 0);
+
+		format_address(&listeners[i].addr, name);
+		journal("Listening on %s over %s.\n", name,
+			(listen->tproto == PROTOCOL_UDP) ? "UDP" : "TCP");
 	}
 }
 
-void tcp_accept_connection(void)
+#if HAVE_EPOLL
+/* A stealing worker waits on its own epoll set, for writes and wakeups */
+static void set_up_stealer(struct worker *w)
 {
-	struct sockaddr_in cli_addr;
-	socklen_t cli_len;
-	int consockfd;
-	const char *buffer;
-	size_t length;
+	struct epoll_event event;
 
-	journal("Listening for connection...\n");
-	if (unlikely(listen(sockfd, TCP_CONNECTION_BACKLOG))) {
+	w->queue = malloc(sizeof(struct fd_queue));
+	if (unlikely(!w->queue)) {
+		journal("Unable to allocate connection queue: %s.\n", strerror(errno));
+		cleanup(EXIT_MEMORY, 1);
+	}
+	fd_queue_init(w->queue);
+	timer_wheel_init(&w->timers, clock_ms());
+
+	w->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(w->epollfd < 0 || w->wakefd < 0)) {
 		const int errsave = errno;
-		assert(errno != 0);
 		JTRACE();
-		journal("Unable to listen on socket: %s.\n", strerror(errsave));
+		journal("Unable to set up worker %u: %s.\n", w->id, strerror(errsave));
 		cleanup(EXIT_IO, 1);
 	}
 
-	cli_len = sizeof(cli_addr);
-	consockfd = accept(sockfd, (struct sockaddr *)(&cli_addr), &cli_len);
-	if (consockfd < 0) {
+	/* The wakeup is the only event without a client */
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (unlikely(epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->wakefd, &event) < 0)) {
 		const int errsave = errno;
-		assert(errno != 0);
 		JTRACE();
-		journal("Unable to accept connection: %s.\n", strerror(errsave));
-		check_socket_error(errsave);
-		return;
+		journal("Unable to watch worker %u's wakeups: %s.\n", w->id, strerror(errsave));
+		cleanup(EXIT_IO, 1);
 	}
+}
+#endif /* HAVE_EPOLL */
 
-#if DEBUG
-	log_client(&cli_addr);
-#endif /* DEBUG */
+static void set_up_sockets(struct worker *w)
+{
+	unsigned int k;
 
-	if (get_quote_of_the_day(&buffer, &length))
-		goto end;
+	for (k = 0; k < listener_count; k++) {
+		if (listeners[k].set != w->id / set_size)
+			continue;
 
-	tcp_write(buffer,
-		  &length,
-		  consockfd);
+		if (listeners[k].shared_fd >= 0) {
+			w->socks[k] = listeners[k].shared_fd;
+		} else {
+			w->socks[k] = make_socket(&listeners[k]);
+			if (listeners[k].type == SOCK_STREAM)
+				tcp_listen(w->socks[k]);
+			if (listeners[k].addr.ss_family == AF_UNIX)
+				listeners[k].shared_fd = w->socks[k];
+		}
 
-end:
-	close(consockfd);
+		w->sockfd = w->socks[k];
+		w->socktype = listeners[k].type;
+		w->sock_count++;
+	}
+	if (w->sock_count > 1)
+		w->sockfd = -1;
+
+#if HAVE_EPOLL
+	/* A lone UDP socket is read with blocking calls instead */
+	if (w->sockfd < 0 || w->socktype == SOCK_STREAM)
+		set_up_event_loop(w);
+#endif /* HAVE_EPOLL */
 }
 
-void udp_accept_connection(void)
+#if HAVE_EPOLL
+/* The CPU a worker is pinned to, taken in turn from the allowed CPUs */
+static unsigned int worker_cpu(const struct worker *w)
 {
-	struct sockaddr_in cli_addr;
-	socklen_t cli_len;
-	const char *buffer;
-	size_t length;
+	unsigned int n, cpu;
 
-	journal("Listening for connection...\n");
-	cli_len = sizeof(cli_addr);
-	if (unlikely(recvfrom(sockfd,
-			      NULL, 0, 0,
-			      (struct sockaddr *)(&cli_addr),
-			      &cli_len) < 0)) {
+	/* The acceptor isn't pinned, so stealing workers start from the first CPU */
+	n = (w->id - (stealing ? 1 : 0)) % CPU_COUNT(&allowed_cpus);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed_cpus) && n-- == 0)
+			break;
+	}
+	return cpu;
+}
+#endif /* HAVE_EPOLL */
+
+#if HAVE_STEERING
+static void set_insn(struct sock_filter *insn,
+		     unsigned short code,
+		     unsigned char jt,
+		     unsigned char jf,
+		     uint32_t k)
+{
+	insn->code = code;
+	insn->jt = jt;
+	insn->jf = jf;
+	insn->k = k;
+}
+
+/*
+ * With SteerByCpu, each reuseport group runs a classic BPF program that
+ * picks the socket of the worker pinned to the CPU a packet arrived on,
+ * so the client is served on the core that took its interrupt, and its
+ * socket stays in that core's cache. The sockets are numbered in the
+ * order they joined the group, which is the order of the workers. A
+ * CPU without a worker gets an index past the end, so the kernel falls
+ * back to its hash.
+ */
+static void steer_by_cpu(unsigned int k, unsigned int set)
+{
+	static struct sock_filter code[2 * MAX_WORKERS + 2];
+	struct sock_fprog prog;
+	struct worker *w;
+	unsigned int i, n;
+	int cpu;
+
+	n = 0;
+	set_insn(&code[n++], BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+	for (i = 0; i < set_size; i++) {
+		w = &workers[set * set_size + i];
+		cpu = (int)worker_cpu(w);
+
+		/* Without the program, newer kernels still prefer the socket for the CPU */
+		setsockopt(w->socks[k], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+
+		set_insn(&code[n++], BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)cpu);
+		set_insn(&code[n++], BPF_RET | BPF_K, 0, 0, i);
+	}
+	set_insn(&code[n++], BPF_RET | BPF_K, 0, 0, set_size);
+
+	prog.len = (unsigned short)n;
+	prog.filter = code;
+	if (unlikely(setsockopt(workers[set * set_size].socks[k],
+				SOL_SOCKET,
+				SO_ATTACH_REUSEPORT_CBPF,
+				&prog,
+				sizeof(prog)) < 0)) {
 		const int errsave = errno;
-		assert(errno != 0);
 		JTRACE();
-		journal("Unable to read from socket: %s.\n", strerror(errsave));
-		check_socket_error(errsave);
-		return;
+		journal("Unable to steer clients by CPU: %s.\n", strerror(errsave));
 	}
+}
+#endif /* HAVE_STEERING */
 
-#if DEBUG
-	log_client(&cli_addr);
-#endif /* DEBUG */
+static void set_up_steering(void)
+{
+#if HAVE_STEERING
+	unsigned int k;
 
-	if (get_quote_of_the_day(&buffer, &length))
+	if (!opt->pin_workers) {
+		journal("SteerByCpu needs PinWorkers, ignoring it.\n");
 		return;
-
-	udp_write(buffer,
-		 &length,
-		 (struct sockaddr *)(&cli_addr),
-		 cli_len);
+	}
+	if (stealing) {
+		journal("SteerByCpu doesn't apply to AcceptMode stealing, ignoring it.\n");
+		return;
+	}
+	if (set_size < 2)
+		return;
+
+	/* Unix sockets are shared rather than grouped */
+	for (k = 0; k < listener_count; k++) {
+		if (listeners[k].addr.ss_family != AF_UNIX)
+			steer_by_cpu(k, listeners[k].set);
+	}
+	journal("Steering clients to the worker on the CPU they arrive on.\n");
+#else
+	journal("SteerByCpu isn't supported here, ignoring it.\n");
+#endif /* HAVE_STEERING */
+}
+
+static void set_up_workers(const struct options *const local_opt, int family)
+{
+	unsigned int i, k, tcp_count;
+	long cpus;
+
+	opt = local_opt;
+	write_timeout = opt->write_timeout * 1000;
+	idle_timeout = opt->idle_timeout * 1000;
+	zerocopy_min = HAVE_ZEROCOPY ? (size_t)opt->zerocopy_threshold * 1024 : 0;
+	worker_count = opt->workers;
+	if (worker_count == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		worker_count = (cpus > 0) ? (unsigned int)cpus : 1;
+	}
+
+	set_count = 1;
+	if (opt->listen_count) {
+		add_configured_listeners();
+	} else if (family == AF_INET) {
+		add_default_listeners(AF_INET, 0, 0);
+	} else if (opt->iproto == PROTOCOL_BOTH && opt->separate_listeners) {
+		/* The first set of workers serves IPv6, the second IPv4 */
+		add_default_listeners(AF_INET6, 1, 0);
+		add_default_listeners(AF_INET, 0, 1);
+		set_count = 2;
+	} else {
+		add_default_listeners(AF_INET6, opt->iproto == PROTOCOL_IPv6, 0);
+	}
+
+	if (opt->unix_stream_path)
+		add_unix_listener(opt->unix_stream_path, SOCK_STREAM);
+	if (opt->unix_dgram_path)
+		add_unix_listener(opt->unix_dgram_path, SOCK_DGRAM);
+
+	tcp_count = 0;
+	for (k = 0; k < listener_count; k++) {
+		if (listeners[k].type == SOCK_STREAM)
+			tcp_count++;
+	}
+
+	if (opt->accept_mode == ACCEPT_STEALING) {
+#if HAVE_EPOLL
+		if (tcp_count)
+			stealing = 1;
+		else
+			journal("AcceptMode only applies to TCP, ignoring it.\n");
+#else
+		journal("AcceptMode stealing isn't supported here, ignoring it.\n");
+#endif /* HAVE_EPOLL */
+	}
+
+	if (opt->tcp_backend == BACKEND_IO_URING) {
+		if (!tcp_count)
+			journal("TcpBackend only applies to TCP, ignoring it.\n");
+		else if (stealing)
+			journal("TcpBackend io_uring doesn't support AcceptMode stealing, using epoll.\n");
+		else if (tcp_count != listener_count || listener_count != set_count)
+			journal("TcpBackend io_uring only serves one TCP socket per worker, using epoll.\n");
+		else
+			use_uring = 1;
+	}
+
+	if (stealing) {
+		/* Worker 0 is the acceptor, for every listener, and the rest serve */
+		for (k = 0; k < listener_count; k++)
+			listeners[k].set = 0;
+		set_count = 1;
+		set_size = 1;
+		worker_count = MIN(worker_count, MAX_WORKERS - 1) + 1;
+		journal("Using an acceptor and %u workers.\n", worker_count - 1);
+	} else {
+		worker_count = MIN(worker_count, MAX_WORKERS / set_count);
+
+#if !HAVE_REUSEPORT
+		if (worker_count > 1) {
+			journal("Multiple workers need SO_REUSEPORT, which isn't supported here.\n");
+			worker_count = 1;
+		}
+#endif /* HAVE_REUSEPORT */
+
+		if (set_count > 1)
+			journal("Using %u workers for each of IPv4 and IPv6.\n", worker_count);
+		else if (worker_count > 1)
+			journal("Using %u workers.\n", worker_count);
+		set_size = worker_count;
+		worker_count *= set_count;
+	}
+
+#if HAVE_EPOLL
+	if (opt->pin_workers && sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus)) {
+		journal("Unable to get the allowed CPUs: %s.\n", strerror(errno));
+		cleanup(EXIT_IO, 1);
+	}
+#endif /* HAVE_EPOLL */
+
+	for (i = 0; i < worker_count; i++) {
+		struct worker *w = &workers[i];
+
+		w->id = i;
+		w->sockfd = -1;
+		for (k = 0; k < MAX_SOCKETS; k++)
+			w->socks[k] = -1;
+#if HAVE_EPOLL
+		w->epollfd = -1;
+		w->spare_fd = -1;
+		w->wakefd = -1;
+
+		if (stealing && i > 0) {
+			set_up_stealer(w);
+			continue;
+		}
+#endif /* HAVE_EPOLL */
+
+		set_up_sockets(w);
+	}
+	if (opt->steer_by_cpu)
+		set_up_steering();
+
+#if HAVE_EPOLL
+	if (tcp_count)
+		raise_fd_limit();
+#endif /* HAVE_EPOLL */
+}
+
+void set_up_ipv4_socket(const struct options *const local_opt)
+{
+	if (!local_opt->listen_count)
+		journal("Setting up IPv4 socket over %s...\n", TPROTO_STRING(local_opt));
+	set_up_workers(local_opt, AF_INET);
+}
+
+void set_up_ipv6_socket(const struct options *const local_opt)
+{
+	if (!local_opt->listen_count)
+		journal("Setting up IPv%s6 socket over %s...\n",
+			IPPROTO_PART_STRING(local_opt),
+			TPROTO_STRING(local_opt));
+	set_up_workers(local_opt, AF_INET6);
+}
+
+void close_socket(void)
+{
+	unsigned int i, k;
+
+	/* Once privileges are dropped this may fail, but the next start replaces them */
+	for (k = 0; k < listener_count; k++) {
+		if (listeners[k].shared_fd >= 0)
+			unlink(((const struct sockaddr_un *)&listeners[k].addr)->sun_path);
+	}
+
+	/* Other workers may still be using them, exiting will close them */
+	if (worker_count > 1)
+		return;
+
+	for (i = 0; i < worker_count; i++) {
+		struct worker *w = &workers[i];
+
+#if HAVE_EPOLL
+		if (w->epollfd >= 0)
+			close(w->epollfd);
+		if (w->spare_fd >= 0)
+			close(w->spare_fd);
+#endif /* HAVE_EPOLL */
+
+		for (k = 0; k < listener_count; k++) {
+			if (w->socks[k] >= 0 && unlikely(close(w->socks[k]))) {
+				const int errsave = errno;
+				assert(errno != 0);
+				journal("Unable to close socket file descriptor %d: %s.\n",
+					w->socks[k], strerror(errsave));
+			}
+		}
+	}
+}
+
+#if !HAVE_EPOLL
+/*
+ * Without an event loop, the client is written to with blocking sends,
+ * each of which gives up after IdleTimeout, until WriteTimeout is up.
+ */
+static void tcp_write(const char *buf,
+		      size_t *len,
+		      int consockfd)
+{
+	const uint32_t deadline = clock_ms() + write_timeout;
+	struct timeval tv;
+
+	if (idle_timeout || write_timeout) {
+		tv.tv_sec = (idle_timeout ? idle_timeout : write_timeout) / 1000;
+		tv.tv_usec = 0;
+		setsockopt(consockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+
+	while (*len > 0) {
+		ssize_t bytes;
+
+		if (write_timeout && TIME_AFTER_EQ(clock_ms(), deadline))
+			return;
+
+		bytes = send(consockfd, buf, *len, MSG_NOSIGNAL);
+		if (unlikely(bytes < 0)) {
+			const int errsave = errno;
+			if (errsave == EAGAIN || errsave == EWOULDBLOCK)
+				return;
+			JTRACE();
+			journal("Unable to write to TCP socket: %s.\n",
+				strerror(errsave));
+			check_socket_error(errsave);
+			return;
+		}
+		buf += bytes;
+		*len -= (size_t)bytes;
+	}
+}
+#endif /* !HAVE_EPOLL */
+
+#if !HAVE_MMSG
+static void udp_write(const char *buf,
+		      size_t *len,
+		      int sockfd,
+		      const struct sockaddr *cli_addr,
+		      socklen_t cli_len)
+{
+	while (*len > 0) {
+		ssize_t bytes;
+
+		bytes = sendto(sockfd, buf, *len, 0, cli_addr, cli_len);
+		if (unlikely(bytes < 0)) {
+			const int errsave = errno;
+			JTRACE();
+			journal("Unable to write to UDP socket: %s.\n",
+				strerror(errsave));
+			check_socket_error(errsave);
+			return;
+		}
+		buf += bytes;
+		*len -= (size_t)bytes;
+	}
+}
+#endif /* !HAVE_MMSG */
+
+#if HAVE_MMSG
+/*
+ * Datagrams are drained with one recvmmsg(), up to the worker's batch
+ * size, and answered with one sendmmsg(). MSG_WAITFORONE only blocks
+ * for the first datagram, so a lone client is answered straight away.
+ *
+ * The batch size doubles whenever a batch fills up, and halves when one
+ * is less than a quarter full, so a quiet worker doesn't set up more
+ * messages than it needs.
+ */
+struct udp_batch {
+	struct mmsghdr msgs[UDP_BATCH_MAX];
+	struct iovec iovs[UDP_BATCH_MAX];
+	struct sockaddr_storage addrs[UDP_BATCH_MAX];
+};
+
+/*
+ * Drops the datagrams that can't be answered, or are from sources over
+ * their rate limit, keeping the rest in order.
+ */
+static unsigned int udp_limit(struct udp_batch *b, unsigned int count)
+{
+	unsigned int i, kept;
+	uint32_t now;
+
+	now = ratelimit_enabled() ? clock_ms() : 0;
+	kept = 0;
+	for (i = 0; i < count; i++) {
+		if (!HAS_NAME(b->msgs[i].msg_hdr.msg_namelen) ||
+		    !ratelimit_allow(&b->addrs[i], now))
+			continue;
+		if (kept != i) {
+			b->addrs[kept] = b->addrs[i];
+			b->msgs[kept].msg_hdr.msg_namelen = b->msgs[i].msg_hdr.msg_namelen;
+		}
+		kept++;
+	}
+	return kept;
+}
+
+static int udp_receive(struct worker *w, int sockfd, struct udp_batch *b)
+{
+	unsigned int i, count;
+	int ret;
+
+	if (unlikely(w->udp_batch == 0))
+		w->udp_batch = 1;
+
+	for (i = 0; i < w->udp_batch; i++) {
+		memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+	}
+
+	ret = recvmmsg(sockfd, b->msgs, w->udp_batch, MSG_WAITFORONE, NULL);
+	if (unlikely(ret < 0)) {
+		const int errsave = errno;
+		assert(errno != 0);
+		if (errsave == EINTR || errsave == EAGAIN || errsave == EWOULDBLOCK)
+			return 0;
+		JTRACE();
+		journal("Unable to read from socket: %s.\n", strerror(errsave));
+		check_socket_error(errsave);
+		return 0;
+	}
+	count = (unsigned int)ret;
+
+	if (count == w->udp_batch)
+		w->udp_batch = MIN(w->udp_batch * 2, UDP_BATCH_MAX);
+	else if (count < w->udp_batch / 4)
+		w->udp_batch /= 2;
+	return (int)udp_limit(b, count);
+}
+
+/* Every response points into the quotes, so this must be called while online */
+static void udp_answer(int sockfd, struct udp_batch *b, unsigned int count)
+{
+	const char *buffer;
+	size_t length;
+	unsigned int i, sent;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+#if DEBUG
+		log_client(&b->addrs[i]);
+#endif /* DEBUG */
+
+		if (get_quote_of_the_day(&buffer, &length))
+			return;
+
+		b->iovs[i].iov_base = (void *)(uintptr_t)buffer;
+		b->iovs[i].iov_len = length;
+		b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (sent = 0; sent < count; sent += (unsigned int)ret) {
+		ret = sendmmsg(sockfd, &b->msgs[sent], count - sent, 0);
+		if (unlikely(ret < 0)) {
+			const int errsave = errno;
+			if (errsave == EINTR) {
+				ret = 0;
+				continue;
+			}
+
+			/* Skip the client that failed, and carry on with the rest */
+			JTRACE();
+			journal("Unable to write to UDP socket: %s.\n", strerror(errsave));
+			check_socket_error(errsave);
+			ret = 1;
+		}
+	}
+}
+
+static void udp_accept(struct worker *w, int sockfd)
+{
+	struct udp_batch batch;
+	int count;
+
+	count = udp_receive(w, sockfd, &batch);
+	if (count == 0)
+		return;
+
+	quotes_online();
+	udp_answer(sockfd, &batch, (unsigned int)count);
+	quotes_offline();
+}
+
+#if HAVE_EPOLL
+/* For a UDP socket in an event loop, which is already online */
+static void udp_drain(struct worker *w, int sockfd)
+{
+	struct udp_batch batch;
+	int count;
+
+	count = udp_receive(w, sockfd, &batch);
+	if (count > 0)
+		udp_answer(sockfd, &batch, (unsigned int)count);
+}
+#endif /* HAVE_EPOLL */
+
+#else
+
+static void udp_accept(struct worker *w, int sockfd)
+{
+	struct sockaddr_storage cli_addr;
+	socklen_t cli_len;
+	const char *buffer;
+	size_t length;
+
+	journal("Listening for connection...\n");
+	cli_len = sizeof(cli_addr);
+	UNUSED(w);
+	if (unlikely(recvfrom(sockfd,
+			      NULL, 0, 0,
+			      (struct sockaddr *)(&cli_addr),
+			      &cli_len) < 0)) {
+		const int errsave = errno;
+		assert(errno != 0);
+		if (errsave == EINTR)
+			return;
+		JTRACE();
+		journal("Unable to read from socket: %s.\n", strerror(errsave));
+		check_socket_error(errsave);
+		return;
+	}
+
+#if DEBUG
+	log_client(&cli_addr);
+#endif /* DEBUG */
+
+	if (!HAS_NAME(cli_len) || !ratelimit_allow(&cli_addr, clock_ms()))
+		return;
+
+	quotes_online();
+	if (get_quote_of_the_day(&buffer, &length))
+		goto end;
+
+	udp_write(buffer,
+		  &length,
+		  sockfd,
+		  (struct sockaddr *)(&cli_addr),
+		  cli_len);
+
+end:
+	quotes_offline();
+}
+#endif /* HAVE_MMSG */
+
+#if HAVE_EPOLL
+
+/*
+ * Clients that are slow to read don't hold anyone else up. Whatever
+ * doesn't fit in the socket buffer straight away is queued, and sent
+ * as the client makes room for it.
+ */
+
+/* Closes a connection that was admitted */
+static void tcp_hang_up(int consockfd)
+{
+	close(consockfd);
+	admission_release();
+}
+
+static void tcp_close_client(struct worker *w, struct tcp_client *client)
+{
+	/* Closing the socket also takes it out of the epoll set */
+	timer_clear(&w->timers, &client->timer);
+	tcp_hang_up(client->fd);
+	release_quotes(client->quotes);
+	free(client);
+}
+
+/*
+ * A client is hung up on once it has had WriteTimeout to read its quote,
+ * or has gone IdleTimeout without reading any of it, whichever is sooner.
+ */
+static void tcp_set_timer(struct worker *w, struct tcp_client *client)
+{
+	uint32_t expires;
+
+	if (!write_timeout && !idle_timeout)
+		return;
+
+	expires = client->deadline;
+	if (idle_timeout && (!write_timeout || TIME_AFTER_EQ(expires, w->now + idle_timeout)))
+		expires = w->now + idle_timeout;
+	timer_set(&w->timers, &client->timer, expires);
+}
+
+/* Resets the connection, so the kernel doesn't go on sending what it has buffered */
+static void tcp_expire(struct timer *timer, void *arg)
+{
+	struct tcp_client *client = (struct tcp_client *)timer;
+	struct linger linger;
+
+	linger.l_onoff = 1;
+	linger.l_linger = 0;
+	setsockopt(client->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	tcp_close_client(arg, client);
+}
+
+static size_t span_length(const struct quote_span *span)
+{
+	return span->head_length + span->length + span->tail_length;
+}
+
+/*
+ * With ZeroCopyThreshold set, large responses are sent straight out of
+ * the quotes' memory with MSG_ZEROCOPY instead of being copied into the
+ * socket buffer. Returns whether this one will be.
+ */
+static int tcp_want_zerocopy(int consockfd, const struct quote_span *span)
+{
+#if HAVE_ZEROCOPY
+	const int one = 1;
+
+	if (!zerocopy_min || MAX(span->head_length, span->tail_length) < zerocopy_min)
+		return 0;
+	return setsockopt(consockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#else
+	UNUSED(consockfd);
+	UNUSED(span);
+	return 0;
+#endif /* HAVE_ZEROCOPY */
+}
+
+/*
+ * Sends from memory. Buffers of at least ZeroCopyThreshold go with
+ * MSG_ZEROCOPY, in chunks, as the kernel charges the pages it pins for
+ * each send against RLIMIT_MEMLOCK. Once that runs out, the client goes
+ * back to plain sends.
+ */
+static ssize_t tcp_send_buffer(int consockfd,
+			       const char *buf,
+			       size_t len,
+			       int flags,
+			       struct zerocopy *zc)
+{
+	size_t chunk, sent = 0;
+	ssize_t bytes;
+
+	if (!zc->on || len < zerocopy_min)
+		return send(consockfd, buf, len, flags);
+
+	while (sent < len) {
+		chunk = MIN(len - sent, ZEROCOPY_CHUNK);
+		bytes = send(consockfd, buf + sent, chunk, flags | MSG_ZEROCOPY);
+		if (bytes < 0) {
+			if (errno != ENOBUFS)
+				return sent ? (ssize_t)sent : -1;
+			zc->on = 0;
+			return sent ? (ssize_t)sent : send(consockfd, buf, len, flags);
+		}
+
+		zc->sent++;
+		sent += (size_t)bytes;
+		if ((size_t)bytes < chunk)
+			break;
+	}
+	return (ssize_t)sent;
+}
+
+/*
+ * Sends as much of what's left of a response as the socket will take,
+ * stopping as soon as it is full. Large quotes go straight from the
+ * quotes file with sendfile(), with their padding sent either side.
+ */
+static int tcp_send_span(int consockfd, struct quote_span *span, struct zerocopy *zc)
+{
+	ssize_t bytes;
+
+	if (span->head_length) {
+		const int more = (span->length || span->tail_length) ? MSG_MORE : 0;
+
+		bytes = tcp_send_buffer(consockfd, span->head, span->head_length,
+					MSG_NOSIGNAL | more, zc);
+		if (bytes < 0)
+			goto blocked;
+		span->head += bytes;
+		span->head_length -= (size_t)bytes;
+		if (span->head_length)
+			return 0;
+	}
+	if (span->length) {
+		bytes = sendfile(consockfd, span->fd, &span->offset, span->length);
+		if (bytes < 0)
+			goto blocked;
+		if (unlikely(bytes == 0)) {
+			/* The quotes file was cut short underneath us */
+			errno = EIO;
+			return -1;
+		}
+		span->length -= (size_t)bytes;
+		if (span->length)
+			return 0;
+	}
+	if (span->tail_length) {
+		bytes = tcp_send_buffer(consockfd, span->tail, span->tail_length,
+					MSG_NOSIGNAL, zc);
+		if (bytes < 0)
+			goto blocked;
+		span->tail += bytes;
+		span->tail_length -= (size_t)bytes;
+	}
+	return 0;
+
+blocked:
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
+
+/*
+ * Reads the kernel's notices of which MSG_ZEROCOPY sends it is done with
+ * off the socket's error queue, and returns how many there were. If it
+ * had to copy the data after all, as it does over loopback, the client
+ * goes back to plain sends.
+ */
+static uint32_t tcp_reap_zerocopy(int consockfd, struct zerocopy *zc)
+{
+#if HAVE_ZEROCOPY
+	union {
+		char buf[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		struct cmsghdr align;
+	} control;
+	const struct sock_extended_err *err;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	uint32_t done = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(consockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			err = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* Sends ee_info to ee_data, inclusive, are finished */
+			done += err->ee_data - err->ee_info + 1;
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc->on = 0;
+		}
+	}
+	zc->done += done;
+	return done;
+#else
+	UNUSED(consockfd);
+	UNUSED(zc);
+	return 0;
+#endif /* HAVE_ZEROCOPY */
+}
+
+static void tcp_queue(struct worker *w,
+		      int consockfd,
+		      const struct quote_span *span,
+		      const struct zerocopy *zc)
+{
+	struct epoll_event event;
+	struct tcp_client *client;
+
+	client = malloc(sizeof(struct tcp_client));
+	if (unlikely(!client)) {
+		journal("Unable to allocate client state: %s.\n", strerror(errno));
+		tcp_hang_up(consockfd);
+		return;
+	}
+	memset(&client->timer, 0, sizeof(client->timer));
+	client->deadline = w->now + write_timeout;
+	client->fd = consockfd;
+	client->left = *span;
+	client->quotes = hold_quotes();
+	client->zc = *zc;
+
+	/* Notices of finished zero-copy sends always wake us, as EPOLLERR */
+	memset(&event, 0, sizeof(event));
+	event.events = span_length(span) ? EPOLLOUT : 0;
+	event.data.ptr = client;
+	if (unlikely(epoll_ctl(w->epollfd, EPOLL_CTL_ADD, consockfd, &event) < 0)) {
+		const int errsave = errno;
+		JTRACE();
+		journal("Unable to watch client socket: %s.\n", strerror(errsave));
+		tcp_close_client(w, client);
+		return;
+	}
+	tcp_set_timer(w, client);
+}
+
+static void tcp_flush(struct worker *w, struct tcp_client *client, uint32_t events)
+{
+	struct epoll_event event;
+	size_t before;
+	uint32_t reaped = 0;
+
+	if (client->zc.sent != client->zc.done)
+		reaped = tcp_reap_zerocopy(client->fd, &client->zc);
+
+	before = span_length(&client->left);
+	if (before && tcp_send_span(client->fd, &client->left, &client->zc) < 0) {
+		journal("Unable to write to TCP socket: %s.\n", strerror(errno));
+		tcp_close_client(w, client);
+		return;
+	}
+
+	if (span_length(&client->left) == 0) {
+		/*
+		 * Everything is sent, but the kernel may still be sending it
+		 * out of the quotes, which mustn't be released until it is
+		 * done. A connection that has hung up won't send any more.
+		 */
+		if (client->zc.sent == client->zc.done || (events & EPOLLHUP)) {
+			tcp_close_client(w, client);
+			return;
+		}
+		if (before) {
+			memset(&event, 0, sizeof(event));
+			event.data.ptr = client;
+			epoll_ctl(w->epollfd, EPOLL_CTL_MOD, client->fd, &event);
+		}
+	}
+
+	if (span_length(&client->left) != before || reaped)
+		tcp_set_timer(w, client);
+}
+
+static void tcp_serve(struct worker *w, int consockfd)
+{
+	struct quote_span span;
+	struct zerocopy zc;
+
+	if (get_quote_span(&span)) {
+		tcp_hang_up(consockfd);
+		return;
+	}
+
+	zc.sent = 0;
+	zc.done = 0;
+	zc.on = tcp_want_zerocopy(consockfd, &span);
+	if (tcp_send_span(consockfd, &span, &zc) < 0) {
+		journal("Unable to write to TCP socket: %s.\n", strerror(errno));
+		tcp_hang_up(consockfd);
+		return;
+	}
+
+	if (span_length(&span) == 0 && zc.sent == 0)
+		tcp_hang_up(consockfd);
+	else
+		tcp_queue(w, consockfd, &span, &zc);
+}
+
+/*
+ * Out of descriptors, so the pending connection can't be accepted, and
+ * the listening socket would stay readable forever. Free up the spare
+ * descriptor to accept the connection and hang up on it.
+ */
+static void tcp_shed_connection(struct worker *w, int sockfd)
+{
+	int consockfd;
+
+	if (w->spare_fd < 0)
+		return;
+
+	close(w->spare_fd);
+	consockfd = accept(sockfd, NULL, NULL);
+	if (consockfd >= 0)
+		close(consockfd);
+	w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	journal("Out of file descriptors, dropped a connection.\n");
+}
+
+/* Work stealing */
+
+static void wake_worker(struct worker *w)
+{
+	const uint64_t one = 1;
+	unsigned int idle;
+	ssize_t ret;
+
+	idle = 1;
+	if (!ATOMIC_CAS(w->idle, idle, 0))
+		return;
+
+	ret = write(w->wakefd, &one, sizeof(one));
+	UNUSED(ret);
+}
+
+/*
+ * Hands a connection to the next worker in turn, waking it if it is
+ * asleep. If it is busy, an idle worker is woken instead to steal it.
+ */
+static void tcp_dispatch(int consockfd)
+{
+	static unsigned int next;
+	struct worker *w;
+	unsigned int i, stealers;
+
+	w = &workers[1];
+	stealers = worker_count - 1;
+	for (i = 0; i < stealers; i++) {
+		w = &workers[next++ % stealers + 1];
+		if (!fd_queue_push(w->queue, consockfd))
+			break;
+	}
+	if (unlikely(i == stealers)) {
+		journal("All worker queues are full, dropping a connection.\n");
+		tcp_hang_up(consockfd);
+		return;
+	}
+
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD(w->idle)) {
+		wake_worker(w);
+		return;
+	}
+	for (i = 1; i <= stealers; i++) {
+		if (ATOMIC_LOAD(workers[i].idle)) {
+			wake_worker(&workers[i]);
+			return;
+		}
+	}
+}
+
+/* Takes a connection from our own queue, or failing that, anyone else's */
+static int tcp_find_work(const struct worker *w)
+{
+	unsigned int i, victim;
+	int consockfd;
+
+	consockfd = fd_queue_take(w->queue);
+	if (consockfd >= 0)
+		return consockfd;
+
+	victim = w->id;
+	for (i = 2; i < worker_count; i++) {
+		victim = victim % (worker_count - 1) + 1;
+		consockfd = fd_queue_take(workers[victim].queue);
+		if (consockfd >= 0)
+			return consockfd;
+	}
+	return -1;
+}
+
+static int tcp_work_pending(void)
+{
+	unsigned int i;
+
+	for (i = 1; i < worker_count; i++) {
+		if (!fd_queue_empty(workers[i].queue))
+			return 1;
+	}
+	return 0;
+}
+
+static void tcp_steal(struct worker *w)
+{
+	struct epoll_event events[EPOLL_BATCH];
+	int i, ready, consockfd, timeout;
+	uint64_t count;
+	ssize_t ret;
+
+	w->now = clock_ms();
+	quotes_online();
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		consockfd = tcp_find_work(w);
+		if (consockfd < 0)
+			break;
+		tcp_serve(w, consockfd);
+	}
+	quotes_offline();
+
+	/*
+	 * Out of work, so go to sleep, but only after saying so and then
+	 * checking again, so that a connection queued in between isn't
+	 * missed. Otherwise just check on the pending writes.
+	 */
+	timeout = 0;
+	if (i < ACCEPT_BATCH) {
+		ATOMIC_STORE(w->idle, 1);
+		ATOMIC_FENCE();
+		if (tcp_work_pending())
+			ATOMIC_STORE(w->idle, 0);
+		else
+			timeout = timer_wheel_timeout(&w->timers);
+	}
+
+	ready = epoll_wait(w->epollfd, events, EPOLL_BATCH, timeout);
+	ATOMIC_STORE(w->idle, 0);
+	if (ready < 0) {
+		const int errsave = errno;
+		if (errsave == EINTR)
+			return;
+		JTRACE();
+		journal("Unable to wait for connections: %s.\n", strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+
+	w->now = clock_ms();
+	quotes_online();
+	for (i = 0; i < ready; i++) {
+		if (events[i].data.ptr) {
+			tcp_flush(w, events[i].data.ptr, events[i].events);
+		} else {
+			ret = read(w->wakefd, &count, sizeof(count));
+			UNUSED(ret);
+		}
+	}
+	timer_wheel_run(&w->timers, w->now, tcp_expire, w);
+	quotes_offline();
+}
+
+static void tcp_accept_batch(struct worker *w, int sockfd)
+{
+	struct sockaddr_storage cli_addr;
+	socklen_t cli_len;
+	int i, consockfd;
+
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		cli_len = sizeof(cli_addr);
+		consockfd = accept4(sockfd,
+				    (struct sockaddr *)(&cli_addr),
+				    &cli_len,
+				    SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (consockfd < 0) {
+			const int errsave = errno;
+
+			switch (errsave) {
+			case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+			case EWOULDBLOCK:
+#endif /* EAGAIN != EWOULDBLOCK */
+			case EINTR:
+				return;
+			case ECONNABORTED:
+			case EPROTO:
+				continue;
+			case EMFILE:
+			case ENFILE:
+				tcp_shed_connection(w, sockfd);
+				return;
+			}
+
+			JTRACE();
+			journal("Unable to accept connection: %s.\n", strerror(errsave));
+			check_socket_error(errsave);
+			return;
+		}
+
+#if DEBUG
+		log_client(&cli_addr);
+#endif /* DEBUG */
+
+		if (!ratelimit_allow(&cli_addr, w->now) ||
+		    !admission_admit(&w->admission, consockfd, w->now)) {
+			close(consockfd);
+			continue;
+		}
+
+		if (stealing)
+			tcp_dispatch(consockfd);
+		else
+			tcp_serve(w, consockfd);
+	}
+}
+
+/* Which listener an event is for, or -1 if it is for a client */
+static int listener_event(const struct worker *w, const void *ptr)
+{
+	unsigned int k;
+
+	for (k = 0; k < listener_count; k++) {
+		if (ptr == &w->socks[k])
+			return (int)k;
+	}
+	return -1;
+}
+
+static void serve_events(struct worker *w)
+{
+	struct epoll_event events[EPOLL_BATCH];
+	int i, k, ready;
+
+	ready = epoll_wait(w->epollfd, events, EPOLL_BATCH, timer_wheel_timeout(&w->timers));
+	if (ready < 0) {
+		const int errsave = errno;
+		if (errsave == EINTR)
+			return;
+		JTRACE();
+		journal("Unable to wait for connections: %s.\n", strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+
+	w->now = clock_ms();
+	quotes_online();
+	for (i = 0; i < ready; i++) {
+		k = listener_event(w, events[i].data.ptr);
+		if (k < 0)
+			tcp_flush(w, events[i].data.ptr, events[i].events);
+		else if (listeners[k].type == SOCK_STREAM)
+			tcp_accept_batch(w, w->socks[k]);
+		else
+			udp_drain(w, w->socks[k]);
+	}
+	timer_wheel_run(&w->timers, w->now, tcp_expire, w);
+	quotes_offline();
+}
+
+#else
+
+static void tcp_accept(int sockfd)
+{
+	struct sockaddr_storage cli_addr;
+	socklen_t cli_len;
+	int consockfd;
+	const char *buffer;
+	size_t length;
+
+	journal("Listening for connection...\n");
+	cli_len = sizeof(cli_addr);
+	consockfd = accept(sockfd, (struct sockaddr *)(&cli_addr), &cli_len);
+	if (consockfd < 0) {
+		const int errsave = errno;
+		assert(errno != 0);
+		if (errsave == EINTR)
+			return;
+		JTRACE();
+		journal("Unable to accept connection: %s.\n", strerror(errsave));
+		check_socket_error(errsave);
+		return;
+	}
+
+#if DEBUG
+	log_client(&cli_addr);
+#endif /* DEBUG */
+
+	if (!ratelimit_allow(&cli_addr, clock_ms())) {
+		close(consockfd);
+		return;
+	}
+
+	quotes_online();
+	if (get_quote_of_the_day(&buffer, &length))
+		goto end;
+
+	tcp_write(buffer,
+		  &length,
+		  consockfd);
+
+end:
+	quotes_offline();
+	close(consockfd);
+}
+
+/* Waits for any of the worker's sockets, then answers each that is ready */
+static void serve_polled(struct worker *w)
+{
+	struct pollfd fds[MAX_SOCKETS];
+	int types[MAX_SOCKETS];
+	unsigned int k, n;
+
+	n = 0;
+	for (k = 0; k < listener_count; k++) {
+		if (w->socks[k] < 0)
+			continue;
+		fds[n].fd = w->socks[k];
+		fds[n].events = POLLIN;
+		types[n++] = listeners[k].type;
+	}
+
+	if (poll(fds, n, -1) < 0) {
+		const int errsave = errno;
+		if (errsave == EINTR)
+			return;
+		JTRACE();
+		journal("Unable to wait for connections: %s.\n", strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+
+	for (k = 0; k < n; k++) {
+		if (!(fds[k].revents & POLLIN))
+			continue;
+		if (types[k] == SOCK_STREAM)
+			tcp_accept(fds[k].fd);
+		else
+			udp_accept(w, fds[k].fd);
+	}
+}
+
+#endif /* HAVE_EPOLL */
+
+/* Workers */
+
+static void pin_worker(const struct worker *w)
+{
+#if HAVE_EPOLL
+	cpu_set_t cpus;
+	unsigned int cpu;
+	int ret;
+
+	cpu = worker_cpu(w);
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret)
+		journal("Unable to pin worker %u to CPU %u: %s.\n",
+			w->id, cpu, strerror(ret));
+#else
+	UNUSED(w);
+#endif /* HAVE_EPOLL */
+}
+
+/* The ring is made on the thread that uses it */
+static void start_ring(struct worker *w)
+{
+	if (!use_uring)
+		return;
+
+	/* A ring can only time each send as a whole */
+	w->ring = uring_create(w->sockfd, write_timeout ? write_timeout : idle_timeout);
+	if (!w->ring)
+		journal("Worker %u is using epoll instead of io_uring.\n", w->id);
+}
+
+static void worker_step(struct worker *w)
+{
+	if (w->ring)
+		uring_run(w->ring);
+	else if (w->sockfd >= 0 && w->socktype == SOCK_DGRAM)
+		udp_accept(w, w->sockfd);
+#if HAVE_EPOLL
+	else if (stealing && w->id > 0)
+		tcp_steal(w);
+	else
+		serve_events(w);
+#else
+	else if (w->sockfd >= 0)
+		tcp_accept(w->sockfd);
+	else
+		serve_polled(w);
+#endif /* HAVE_EPOLL */
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w;
+
+	w = arg;
+	if (register_quote_reader())
+		return NULL;
+	if (opt->pin_workers)
+		pin_worker(w);
+	start_ring(w);
+
+	for (;;)
+		worker_step(w);
+	return NULL;
+}
+
+/*
+ * Starts every worker but the first, which the main thread runs by
+ * calling tcp_accept_connection() or udp_accept_connection().
+ */
+int start_workers(void)
+{
+	sigset_t all, old;
+	unsigned int i;
+	int ret;
+
+	if (register_quote_reader())
+		return -1;
+
+	if (opt->pin_workers) {
+#if HAVE_EPOLL
+		if (!stealing)
+			pin_worker(&workers[0]);
+#else
+		journal("Pinning workers to CPUs isn't supported here.\n");
+#endif /* HAVE_EPOLL */
+	}
+
+	start_ring(&workers[0]);
+
+	/* Leave signal handling to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = 0;
+	for (i = 1; i < worker_count; i++) {
+		ret = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+		if (ret) {
+			journal("Unable to start worker %u: %s.\n", i, strerror(ret));
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return ret ? -1 : 0;
+}
+
+void tcp_accept_connection(void)
+{
+	worker_step(&workers[0]);
+}
+
+void udp_accept_connection(void)
+{
+	worker_step(&workers[0]);
 }
@@ -26,6 +26,7 @@
 void set_up_ipv4_socket(const struct options *opt);
 void set_up_ipv6_socket(const struct options *opt);
 void close_socket(void);
+int start_workers(void);
 
 void tcp_accept_connection(void);
 void udp_accept_connection(void);
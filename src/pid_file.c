@@ -76,7 +76,8 @@ void pidfile_create(const struct options *opt)
 
 void pidfile_remove(const struct options *opt)
 {
-	if (!opt->pid_file)
+	/* Don't remove a pid file some other instance wrote */
+	if (!opt->pid_file || !wrote_pidfile)
 		return;
 
 	if (access(opt->pid_file, F_OK)) {
@@ -0,0 +1,329 @@
+/*
+ * quote_index.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__)
+# define _GNU_SOURCE
+#endif /* __linux__ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "core.h"
+#include "journal.h"
+#include "latency.h"
+#include "quote_index.h"
+
+#define QUOTE_INDEX_MAGIC		"QOTDIDX"
+#define QUOTE_INDEX_VERSION		2
+#define QUOTE_INDEX_BYTE_ORDER		0x01020304
+
+#define FNV_OFFSET_BASIS		UINT64_C(14695981039346656037)
+#define FNV_PRIME			UINT64_C(1099511628211)
+
+#if defined(__linux__)
+# define MTIME_NSEC(st)			((st)->st_mtim.tv_nsec)
+#else
+# define MTIME_NSEC(st)			0
+#endif /* __linux__ */
+
+/*
+ * The index is a header followed by the offset of every quote and then
+ * the length of every quote. It is only meant to be read on machines
+ * with the same byte order and type sizes as the one that wrote it,
+ * which the header records.
+ *
+ * Whether the quotes file has changed since is told from its size,
+ * modification time and inode, so loading never reads the file. With
+ * VerifyQuotesIndex, the checksum is compared instead, so an index can
+ * be built once and shipped alongside the quotes file.
+ */
+struct quote_index_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t version;
+	uint32_t linediv;
+	uint32_t entry_size;
+	uint64_t corpus_size;
+	uint64_t corpus_checksum;
+	uint64_t corpus_device;
+	uint64_t corpus_inode;
+	int64_t corpus_mtime;
+	int64_t corpus_mtime_nsec;
+	uint64_t count;
+};
+
+static char default_path[PATH_MAX];
+
+/*
+ * FNV-1a, taken a word at a time. This is only used to tell whether an
+ * index still matches its quotes file, so it trades mixing for speed.
+ */
+uint64_t corpus_checksum(const char *data, size_t length)
+{
+	uint64_t hash, word;
+	size_t i;
+
+	hash = FNV_OFFSET_BASIS;
+	for (i = 0; i + sizeof(word) <= length; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		hash ^= word;
+		hash *= FNV_PRIME;
+	}
+	for (; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+const char *quote_index_path(const struct options *const opt)
+{
+	if (!opt->use_index)
+		return NULL;
+	if (opt->index_file)
+		return opt->index_file;
+
+	if (strlen(opt->quotes_file) + sizeof(QUOTE_INDEX_SUFFIX) > sizeof(default_path)) {
+		journal("Quotes file path is too long to derive an index path from.\n");
+		return NULL;
+	}
+	sprintf(default_path, "%s%s", opt->quotes_file, QUOTE_INDEX_SUFFIX);
+	return default_path;
+}
+
+static int stat_corpus(int corpus_fd, struct stat *stbuf)
+{
+	if (fstat(corpus_fd, stbuf)) {
+		journal("Unable to stat quotes file: %s.\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int check_header(const struct quote_index_header *hdr,
+			size_t file_size,
+			enum quote_divider linediv,
+			const char *corpus,
+			size_t corpus_size,
+			const struct stat *corpus_stat,
+			int verify)
+{
+	if (memcmp(hdr->magic, QUOTE_INDEX_MAGIC, sizeof(QUOTE_INDEX_MAGIC))) {
+		journal("Quotes index is not an index file.\n");
+		return -1;
+	}
+	if (hdr->byte_order != QUOTE_INDEX_BYTE_ORDER) {
+		journal("Quotes index was built on an incompatible machine.\n");
+		return -1;
+	}
+	if (hdr->version != QUOTE_INDEX_VERSION) {
+		journal("Quotes index is version %u, but version %u is needed.\n",
+			hdr->version, QUOTE_INDEX_VERSION);
+		return -1;
+	}
+	if (hdr->entry_size != sizeof(uint32_t)) {
+		journal("Quotes index was built on an incompatible machine.\n");
+		return -1;
+	}
+	if (hdr->linediv != (uint32_t)linediv) {
+		journal("Quotes index was built for a different quote divider.\n");
+		return -1;
+	}
+	if (hdr->count > (file_size - sizeof(*hdr)) / (2 * sizeof(uint32_t)) ||
+	    sizeof(*hdr) + hdr->count * 2 * sizeof(uint32_t) != file_size) {
+		journal("Quotes index is truncated or corrupt.\n");
+		return -1;
+	}
+	if (hdr->corpus_size != corpus_size) {
+		journal("Quotes index is out of date with the quotes file.\n");
+		return -1;
+	}
+
+	/* A checked index may have been built elsewhere and copied here */
+	if (verify) {
+		if (hdr->corpus_checksum != corpus_checksum(corpus, corpus_size)) {
+			journal("Quotes index doesn't match the checksum of the quotes file.\n");
+			return -1;
+		}
+		return 0;
+	}
+	if (hdr->corpus_device != (uint64_t)corpus_stat->st_dev ||
+	    hdr->corpus_inode != (uint64_t)corpus_stat->st_ino ||
+	    hdr->corpus_mtime != (int64_t)corpus_stat->st_mtime ||
+	    hdr->corpus_mtime_nsec != (int64_t)MTIME_NSEC(corpus_stat)) {
+		journal("Quotes index is out of date with the quotes file.\n");
+		return -1;
+	}
+	return 0;
+}
+
+int quote_index_load(struct quote_index *idx,
+		     const char *path,
+		     enum quote_divider linediv,
+		     const char *corpus,
+		     size_t corpus_size,
+		     int corpus_fd,
+		     int verify)
+{
+	const struct quote_index_header *hdr;
+	const uint32_t *offsets, *lengths;
+	struct stat stbuf, corpus_stat;
+	void *ptr;
+	size_t i;
+	int fd;
+
+	memset(idx, 0, sizeof(*idx));
+	if (stat_corpus(corpus_fd, &corpus_stat))
+		return -1;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			journal("Unable to open quotes index \"%s\": %s.\n",
+				path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &stbuf)) {
+		journal("Unable to stat quotes index \"%s\": %s.\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if ((size_t)stbuf.st_size < sizeof(*hdr)) {
+		journal("Quotes index \"%s\" is too small to be an index.\n", path);
+		close(fd);
+		return -1;
+	}
+
+	ptr = mmap(NULL, stbuf.st_size, PROT_READ,
+		   MAP_PRIVATE | latency_map_flags(), fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		journal("Unable to map quotes index \"%s\": %s.\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	hdr = ptr;
+	if (check_header(hdr, stbuf.st_size, linediv, corpus, corpus_size,
+			 &corpus_stat, verify))
+		goto fail;
+	offsets = (const uint32_t *)(hdr + 1);
+	lengths = offsets + hdr->count;
+
+	/* Don't trust the entries to stay inside the corpus */
+	for (i = 0; i < hdr->count; i++) {
+		if (offsets[i] > corpus_size ||
+		    lengths[i] > corpus_size - offsets[i]) {
+			journal("Quotes index has an entry outside of the quotes file.\n");
+			goto fail;
+		}
+	}
+
+	idx->table.offsets = offsets;
+	idx->table.lengths = lengths;
+	idx->table.length = hdr->count;
+	idx->region = ptr;
+	idx->region_size = stbuf.st_size;
+	return 0;
+
+fail:
+	munmap(ptr, stbuf.st_size);
+	return -1;
+}
+
+void quote_index_unload(struct quote_index *idx)
+{
+	if (idx->region)
+		munmap(idx->region, idx->region_size);
+	memset(idx, 0, sizeof(*idx));
+}
+
+int quote_index_save(const char *path,
+		     enum quote_divider linediv,
+		     const char *corpus,
+		     size_t corpus_size,
+		     int corpus_fd,
+		     const struct quote_table *table)
+{
+	struct quote_index_header hdr;
+	struct stat corpus_stat;
+	char tmp_path[PATH_MAX];
+	FILE *fh;
+
+	if (strlen(path) + sizeof(".tmp") > sizeof(tmp_path)) {
+		journal("Quotes index path is too long.\n");
+		return -1;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+	if (stat_corpus(corpus_fd, &corpus_stat))
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, QUOTE_INDEX_MAGIC, sizeof(QUOTE_INDEX_MAGIC));
+	hdr.byte_order = QUOTE_INDEX_BYTE_ORDER;
+	hdr.version = QUOTE_INDEX_VERSION;
+	hdr.linediv = linediv;
+	hdr.entry_size = sizeof(uint32_t);
+	hdr.corpus_size = corpus_size;
+	hdr.corpus_checksum = corpus_checksum(corpus, corpus_size);
+	hdr.corpus_device = corpus_stat.st_dev;
+	hdr.corpus_inode = corpus_stat.st_ino;
+	hdr.corpus_mtime = corpus_stat.st_mtime;
+	hdr.corpus_mtime_nsec = MTIME_NSEC(&corpus_stat);
+	hdr.count = table->length;
+
+	/*
+	 * Write to a temporary file and rename it over the old index, since
+	 * a running daemon may have the old one mapped.
+	 */
+	fh = fopen(tmp_path, "wb");
+	if (!fh) {
+		journal("Unable to open \"%s\": %s.\n", tmp_path, strerror(errno));
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fh) != 1 ||
+	    (table->length &&
+	     (fwrite(table->offsets, sizeof(uint32_t), table->length, fh) != table->length ||
+	      fwrite(table->lengths, sizeof(uint32_t), table->length, fh) != table->length))) {
+		journal("Unable to write quotes index: %s.\n", strerror(errno));
+		fclose(fh);
+		unlink(tmp_path);
+		return -1;
+	}
+	if (fclose(fh)) {
+		journal("Unable to write quotes index: %s.\n", strerror(errno));
+		unlink(tmp_path);
+		return -1;
+	}
+	if (rename(tmp_path, path)) {
+		journal("Unable to move quotes index into place at \"%s\": %s.\n",
+			path, strerror(errno));
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
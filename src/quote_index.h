@@ -0,0 +1,69 @@
+/*
+ * quote_index.h
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QUOTE_INDEX_H_
+#define _QUOTE_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#define QUOTE_INDEX_SUFFIX		".idx"
+
+/*
+ * Quotes are stored as parallel arrays of 32-bit offsets and lengths
+ * into the quotes file, so the file can't be larger than this.
+ */
+#define QUOTE_CORPUS_MAX		UINT32_MAX
+
+struct quote_table {
+	const uint32_t *offsets;
+	const uint32_t *lengths;
+	size_t length;
+};
+
+struct quote_index {
+	struct quote_table table;
+
+	void *region;
+	size_t region_size;
+};
+
+uint64_t corpus_checksum(const char *data, size_t length);
+const char *quote_index_path(const struct options *opt);
+
+int quote_index_load(struct quote_index *idx,
+		     const char *path,
+		     enum quote_divider linediv,
+		     const char *corpus,
+		     size_t corpus_size,
+		     int corpus_fd,
+		     int verify);
+void quote_index_unload(struct quote_index *idx);
+
+int quote_index_save(const char *path,
+		     enum quote_divider linediv,
+		     const char *corpus,
+		     size_t corpus_size,
+		     int corpus_fd,
+		     const struct quote_table *table);
+
+#endif /* _QUOTE_INDEX_H_ */
@@ -18,8 +18,12 @@
  * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <assert.h>
@@ -32,10 +36,16 @@
 #include "core.h"
 #include "daemon.h"
 #include "journal.h"
+#include "latency.h"
+#include "quote_index.h"
+#include "rng.h"
+#include "scan.h"
 #include "security.h"
 #include "quotes.h"
 
 #define QUOTE_SIZE		512  /* Set by RFC 865 */
+#define PARSE_CHUNK_MIN		(8 * 1024 * 1024)
+#define PARSER_THREADS_MAX	64
 
 #if defined(__APPLE__)
 # define FSEEK			fseek
@@ -47,43 +57,114 @@ int gethostname(char *name,
 # define FTELL			ftello
 #endif /* __APPLE__ */
 
+#define NO_QUOTE		((size_t)-1)
+#define DAY_KEY(tm)		((unsigned long)(tm)->tm_year << 16 | (tm)->tm_yday)
+#define DAILY_CHECK_INTERVAL	(60 * 60)
+
 #if !defined(HOST_NAME_MAX)
 # define HOST_NAME_MAX		256
 #endif /* HOST_NAME_MAX */
 
 /* Static data */
 
+/*
+ * Large quotes can be sent straight from the quotes file. Then the
+ * rendered bytes are only its padding, unless something needs the whole
+ * response in memory as well. Where in the file it is comes from the
+ * quote table, so all a response keeps is a bit in from_file.
+ */
+struct response {
+	uint32_t offset;
+	uint32_t length;
+};
+
+#define FROM_FILE_SIZE(count)	(((count) + CHAR_BIT - 1) / CHAR_BIT)
+#define SENT_FROM_FILE(qd,n)	((qd)->from_file && \
+				 ((qd)->from_file[(n) / CHAR_BIT] >> ((n) % CHAR_BIT) & 1))
+
+struct quote_data {
+	/* Every quote in the file, including empty ones */
+	struct quote_table table;
+
+	uint32_t *parsed;
+	struct quote_index index;
+
+	const char *corpus;
+	size_t corpus_size;
+	void *region;
+	int file_fd;		/* for sending from, or -1 */
+	unsigned mapped : 1;
+
+	/*
+	 * The non-empty quotes, and what is sent for each of them. Picking
+	 * a quote is just picking an index into these.
+	 */
+	uint32_t *ids;
+	struct response *responses;
+	unsigned char *from_file;	/* a bit per response, or NULL if none are */
+	size_t count;
+	char *rendered;
+	size_t rendered_size;
+	unsigned spans_only : 1;	/* whether quotes sent from the file aren't rendered */
+
+	/* Today's quote, when DailyQuotes is on */
+	size_t daily;
+
+	/* One for being the live quotes, and one for each hold_quotes() */
+	unsigned long refs;
+};
+
+/*
+ * Each serving thread is a reader of the live quotes. A reader is
+ * online while it is handling requests and offline while it waits for
+ * more, and it records the reload epoch it saw when it came online. Old
+ * quotes are only freed once every reader has been offline or seen a
+ * newer epoch, so the request path takes no locks or references.
+ */
+struct quote_reader {
+	unsigned long epoch;	/* 0 while offline */
+	char pad[CACHE_LINE_SIZE - sizeof(unsigned long)];
+};
+
 static FILE *quotes_fh;
 static const struct options *opt;
+static struct quote_data *quote_file_data;
 
-static struct {
-	char **array;
-	size_t length;
+static struct quote_reader readers[MAX_WORKERS];
+static unsigned int reader_count;
+static unsigned long reader_epoch = 1;
+static THREAD_LOCAL struct quote_reader *reader;
+static THREAD_LOCAL struct quote_data *reading;
 
-	char *buffer;
-	size_t buf_length;
-} quote_file_data;
+static pthread_mutex_t daily_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t daily_wakeup = PTHREAD_COND_INITIALIZER;
 
 static struct {
-	char *data;
-	size_t length;
-	size_t str_length;
-} quote_buffer;
+	pthread_t thread;
+
+	size_t quote, next_quote;
+	unsigned long today, tomorrow;
+	time_t rollover;
+	unsigned valid   : 1;
+	unsigned running : 1;
+} daily;
 
 /* Utilites */
 
 #if DEBUG
-static void print_quotes(void)
+static void print_quotes(const struct quote_data *qd)
 {
-	unsigned int i;
+	unsigned long i;
 
 	journal("Printing %lu quote%s:\n",
-		quote_file_data.length,
-		PLURAL(quote_file_data.length));
-
-	for (i = 0; i < quote_file_data.length; i++)
-		journal("#%lu: %s<end>\n",
-			i, quote_file_data.array[i]);
+		(unsigned long)qd->table.length,
+		PLURAL(qd->table.length));
+
+	for (i = 0; i < qd->table.length; i++)
+		journal("#%lu: %.*s<end>\n",
+			i,
+			(int)qd->table.lengths[i],
+			qd->corpus + qd->table.offsets[i]);
 }
 #endif /* DEBUG */
 
@@ -99,89 +180,370 @@ static unsigned long djb2_hash(const char *str)
 	return hash;
 }
 
-static void seed_randgen(void)
+/* Each serving thread has its own generator, seeded on first use */
+static struct rng *thread_rng(void)
 {
-	char hostname[HOST_NAME_MAX + 1];
-	time_t rawtime;
-	const struct tm *ltime;
-	unsigned int seed;
+	static THREAD_LOCAL struct rng rng;
+	static THREAD_LOCAL int seeded;
 
-	rawtime = time(NULL);
-	if (!opt->is_daily) {
-		srand(rawtime);
-		return;
+	if (unlikely(!seeded)) {
+		rng_seed(&rng, rng_entropy(), (uint64_t)(size_t)&rng);
+		seeded = 1;
 	}
+	return &rng;
+}
 
-	/* Create random seed based on current day and hostname */
+/*
+ * Copies a quote out of the corpus. The corpus may be a read-only
+ * mapping, so null bytes are turned into spaces here rather than
+ * in the file data.
+ */
+static void copy_quote(char *dest, const char *src, size_t length)
+{
+	size_t i;
 
-	ltime = localtime(&rawtime);
-	seed = ltime->tm_year << 16 | ltime->tm_yday;
-	if (!gethostname(hostname, sizeof(hostname))) {
-		hostname[sizeof(hostname) - 1] = '\0';
-		seed ^= djb2_hash(hostname);
+	memcpy(dest, src, length);
+	for (i = scan_byte(dest, length, '\0');
+	     i < length;
+	     i += scan_byte(dest + i, length - i, '\0'))
+		dest[i] = ' ';
+}
+
+static size_t rendered_length(size_t length)
+{
+	if (opt->pad_quotes) {
+		/* The pattern is "\n%s\n\n", so the total length is the quote + 3 */
+		length += 3;
 	}
-	srand(seed);
+	if (!opt->allow_big && length > QUOTE_SIZE)
+		length = QUOTE_SIZE;
+	return length;
 }
 
-static int format_quote(void)
+#if defined(__linux__)
+/*
+ * Only TCP served from an event loop can send from the file, so unless
+ * that's all there is, every quote is rendered in full as well.
+ */
+static int spans_only(void)
 {
-	size_t quoteno, length, i;
+	unsigned int i;
 
-	i = quoteno = rand() % quote_file_data.length;
-	while (unlikely(EMPTYSTR(quote_file_data.array[i]))) {
-		i = (i + 1) % quote_file_data.length;
+	if (opt->tcp_backend == BACKEND_IO_URING || opt->unix_dgram_path)
+		return 0;
+	if (!opt->listen_count)
+		return opt->tproto == PROTOCOL_TCP;
 
-		if (i == quoteno) {
-			/* All the lines are blank, this will cause an infinite loop. */
-			journal("Quotes file has only empty entries.\n");
-			return -1;
+	for (i = 0; i < opt->listen_count; i++) {
+		if (opt->listen[i].tproto != PROTOCOL_TCP)
+			return 0;
+	}
+	return 1;
+}
+
+/* Quotes with NULs in them have those replaced, so have to be rendered */
+static int sent_from_file(const struct quote_data *qd, size_t i)
+{
+	const size_t offset = qd->table.offsets[i];
+	const size_t length = qd->table.lengths[i];
+
+	return opt->sendfile_threshold &&
+	       opt->allow_big &&
+	       length >= (size_t)opt->sendfile_threshold * 1024 &&
+	       scan_byte(qd->corpus + offset, length, '\0') == length;
+}
+
+static int open_file_for_sending(struct quote_data *qd)
+{
+	/* The quotes file is closed on reload, while these quotes may be kept */
+	qd->file_fd = dup(fileno(quotes_fh));
+	if (unlikely(qd->file_fd < 0)) {
+		journal("Unable to duplicate quotes file descriptor, not sending from it: %s.\n",
+			strerror(errno));
+		return -1;
+	}
+	fcntl(qd->file_fd, F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+#else
+# define spans_only()		0
+# define sent_from_file(qd,i)	0
+# define open_file_for_sending(qd)	(-1)
+#endif /* __linux__ */
+
+/*
+ * Writes the bytes that go out on the wire for each quote into one
+ * buffer, padded and truncated as configured. This happens once per
+ * load, so sending a quote is just handing out a pointer and length.
+ */
+static int render_quotes(struct quote_data *qd)
+{
+	const struct quote_table *table = &qd->table;
+	const size_t pad = opt->pad_quotes ? 3 : 0;
+	struct response *responses;
+	size_t i, count, total, truncated, from_file;
+	unsigned char *file_bits;
+	uint32_t *ids;
+	char *rendered;
+
+	count = 0;
+	total = 0;
+	truncated = 0;
+	from_file = 0;
+	qd->spans_only = spans_only();
+	for (i = 0; i < table->length; i++) {
+		const size_t length = rendered_length(table->lengths[i]);
+
+		if (table->lengths[i] == 0)
+			continue;
+
+		count++;
+		if (length < table->lengths[i] + pad)
+			truncated++;
+
+		if (sent_from_file(qd, i)) {
+			from_file++;
+			if (qd->spans_only) {
+				total += pad;
+				continue;
+			}
 		}
+		total += length;
 	}
 
-	length = strlen(quote_file_data.array[i]) + 1;
-	if (opt->pad_quotes) {
-		/*
-		 * The pattern is "\n%s\n\n", so the total length is strlen + 3,
-		 * with one byte for the null byte.
-		 */
+	/* Without a descriptor to send from, everything goes out from memory */
+	if (from_file && open_file_for_sending(qd)) {
+		from_file = 0;
+		qd->spans_only = 0;
+		total = 0;
+		for (i = 0; i < table->length; i++) {
+			if (table->lengths[i])
+				total += rendered_length(table->lengths[i]);
+		}
+	}
 
-		length += 3;
+	/* Responses are addressed with 32 bits, like the quotes file */
+	if (total > QUOTE_CORPUS_MAX) {
+		journal("Rendered quotes come to %lu bytes, but 4 GiB or more isn't supported.\n",
+			(unsigned long)total);
+		return -1;
+	}
+
+	ids = latency_alloc(MAX(count, 1) * sizeof(uint32_t));
+	responses = latency_alloc(MAX(count, 1) * sizeof(struct response));
+	rendered = latency_alloc(MAX(total, 1));
+	file_bits = from_file ? calloc(FROM_FILE_SIZE(count), 1) : NULL;
+	if (unlikely(!ids || !responses || !rendered || (from_file && !file_bits))) {
+		journal("Unable to allocate formatted quote buffer: %s.\n", strerror(errno));
+		free(ids);
+		free(responses);
+		free(rendered);
+		free(file_bits);
+		return -1;
+	}
+
+	count = 0;
+	total = 0;
+	for (i = 0; i < table->length; i++) {
+		const size_t quote_length = table->lengths[i];
+		size_t length = rendered_length(quote_length);
+		char *dest = rendered + total;
+		int file;
+		size_t pos;
+
+		if (quote_length == 0)
+			continue;
+
+		file = from_file && sent_from_file(qd, i);
+		if (file)
+			file_bits[count / CHAR_BIT] |= 1 << (count % CHAR_BIT);
+
+		pos = 0;
+		if (opt->pad_quotes)
+			dest[pos++] = '\n';
+
+		if (file && qd->spans_only) {
+			/* Just the padding either side of what comes from the file */
+			length = pad;
+		} else {
+			copy_quote(dest + pos,
+				   qd->corpus + table->offsets[i],
+				   MIN(quote_length, length - pos));
+			pos += MIN(quote_length, length - pos);
+		}
+
+		/* Trailing padding, if it wasn't truncated away */
+		while (pos < length)
+			dest[pos++] = '\n';
+
+		ids[count] = i;
+		responses[count].offset = (uint32_t)total;
+		responses[count].length = (uint32_t)length;
+		count++;
+		total += length;
 	}
 
-	if (!opt->allow_big && length > QUOTE_SIZE) {
-		journal("Quote is %u bytes, which is %u bytes too long. Truncating to %u bytes.\n",
-			length,
-			length - QUOTE_SIZE,
+	if (truncated) {
+		journal("%lu quote%s longer than %u bytes and will be truncated.\n",
+			(unsigned long)truncated,
+			(truncated == 1) ? " is" : "s are",
 			QUOTE_SIZE);
-		length = QUOTE_SIZE;
+	}
+	if (from_file) {
+		journal("%lu quote%s will be sent straight from the quotes file.\n",
+			(unsigned long)from_file,
+			PLURAL(from_file));
 	}
 
-	if (length > quote_buffer.length) {
-		void *ptr;
+	qd->ids = ids;
+	qd->responses = responses;
+	qd->from_file = file_bits;
+	qd->count = count;
+	qd->rendered = rendered;
+	qd->rendered_size = MAX(total, 1);
+	return 0;
+}
 
-		ptr = realloc(quote_buffer.data, length);
-		if (unlikely(!ptr)) {
-			journal("Unable to allocate formatted quote buffer: %s.\n", strerror(errno));
-			return -1;
-		}
-		quote_buffer.data = ptr;
-		quote_buffer.length = length;
+/* Picks an index into the non-empty quotes */
+static int pick_quote(const struct quote_data *qd, size_t *const choice)
+{
+	if (qd->table.length == 0) {
+		journal("Quotes file is empty.\n");
+		return -1;
 	}
 
-	if (opt->pad_quotes)
-		sprintf(quote_buffer.data, "\n%s\n\n", quote_file_data.array[i]);
+	if (opt->is_daily)
+		*choice = ATOMIC_LOAD(qd->daily);
+	else if (unlikely(qd->count == 0))
+		*choice = NO_QUOTE;
 	else
-		strncpy(quote_buffer.data, quote_file_data.array[i], length);
+		*choice = rng_bounded(thread_rng(), (uint32_t)qd->count);
 
-	if (opt->pad_quotes)
-		journal("Sending quotation:%s<end>\n", quote_buffer.data);
-	else
-		journal("Sending quotation:\n%s<end>\n", quote_buffer.data);
+	if (unlikely(*choice == NO_QUOTE)) {
+		journal("Quotes file has only empty entries.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int send_quote(const struct quote_data *qd,
+		      size_t choice,
+		      const char **const buffer,
+		      size_t *const length)
+{
+	const struct response *response;
+
+	response = &qd->responses[choice];
+	if (unlikely(qd->spans_only && SENT_FROM_FILE(qd, choice))) {
+		JTRACE();
+		journal("Internal error: quote #%lu is only in the quotes file.\n",
+			(unsigned long)qd->ids[choice]);
+		return -1;
+	}
+
+	*buffer = qd->rendered + response->offset;
+	*length = response->length;
+
+#if DEBUG
+	journal("Sending quotation #%lu:\n%.*s<end>\n",
+		(unsigned long)qd->ids[choice],
+		(int)*length, *buffer);
+#endif /* DEBUG */
 
-	quote_buffer.str_length = length;
 	return 0;
 }
 
+/* Daily quotes */
+
+/*
+ * Chooses the quote for a day, seeded from the date and hostname so that
+ * it is the same for the whole day and differs between machines.
+ */
+static size_t pick_daily_quote(const struct quote_data *qd, unsigned long day)
+{
+	char hostname[HOST_NAME_MAX + 1];
+	struct rng rng;
+	uint64_t seed;
+
+	seed = day;
+	if (!gethostname(hostname, sizeof(hostname))) {
+		hostname[sizeof(hostname) - 1] = '\0';
+		seed ^= (uint64_t)djb2_hash(hostname) << 32;
+	}
+	rng_seed(&rng, seed, 0);
+	return rng_bounded(&rng, (uint32_t)qd->count);
+}
+
+/*
+ * Works out the current and next day's quotes, and when to switch
+ * between them. Dates are only looked at here, so changes in timezone
+ * or daylight saving time are picked up the next time the timer fires,
+ * and the request path never calls localtime().
+ *
+ * Must be called with daily_lock held.
+ */
+static void daily_refresh(struct quote_data *qd)
+{
+	struct tm tm;
+	time_t now;
+	unsigned long day;
+
+	if (qd->count == 0) {
+		ATOMIC_STORE(qd->daily, NO_QUOTE);
+		return;
+	}
+
+	tzset();
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	day = DAY_KEY(&tm);
+	if (day != daily.today || !daily.valid) {
+		daily.quote = (day == daily.tomorrow && daily.valid)
+			? daily.next_quote
+			: pick_daily_quote(qd, day);
+		daily.today = day;
+	}
+	ATOMIC_STORE(qd->daily, daily.quote);
+
+	/* Local midnight, letting mktime() deal with DST */
+	tm.tm_mday++;
+	tm.tm_hour = 0;
+	tm.tm_min = 0;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	daily.rollover = mktime(&tm);
+
+	localtime_r(&daily.rollover, &tm);
+	day = DAY_KEY(&tm);
+	if (day != daily.tomorrow || !daily.valid) {
+		daily.next_quote = pick_daily_quote(qd, day);
+		daily.tomorrow = day;
+	}
+	daily.valid = 1;
+}
+
+static void *daily_timer(void *arg)
+{
+	struct timespec deadline;
+
+	UNUSED(arg);
+	latency_set_realtime(0);
+	pthread_mutex_lock(&daily_lock);
+	for (;;) {
+		const time_t now = time(NULL);
+
+		/*
+		 * Wake up at midnight to switch quotes, and at least once an
+		 * hour to notice if the timezone or the clock has changed.
+		 */
+		deadline.tv_sec = MIN(daily.rollover, now + DAILY_CHECK_INTERVAL);
+		deadline.tv_nsec = 0;
+		pthread_cond_timedwait(&daily_wakeup, &daily_lock, &deadline);
+		daily_refresh(quote_file_data);
+	}
+	return NULL;
+}
+
 static size_t get_file_size(void)
 {
 	off_t size;
@@ -201,240 +563,426 @@ static size_t get_file_size(void)
 	return size;
 }
 
-static int readquotes_file(void)
+static int map_file(struct quote_data *qd, size_t fsize)
 {
-	size_t i, fsize;
+	void *ptr;
+
+	ptr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE | latency_map_flags(),
+		   fileno(quotes_fh), 0);
+	if (ptr == MAP_FAILED) {
+		journal("Unable to map quotes file, reading it instead: %s.\n",
+			strerror(errno));
+		return -1;
+	}
+
+	qd->region = ptr;
+	qd->corpus = ptr;
+	qd->corpus_size = fsize;
+	qd->mapped = 1;
+	return 0;
+}
+
+static int read_file(struct quote_data *qd)
+{
+	char *buffer;
+	size_t fsize;
 
 	fsize = get_file_size();
 	if (unlikely(fsize == (size_t)-1))
 		return -1;
+	if (fsize > QUOTE_CORPUS_MAX) {
+		journal("Quotes file is %lu bytes, but files of 4 GiB or more aren't supported.\n",
+			(unsigned long)fsize);
+		return -1;
+	}
 
-	/* Allocate file buffer */
-	if (fsize > quote_file_data.buf_length) {
-		void *ptr;
+	/* mmap() refuses zero-length mappings */
+	if (fsize == 0) {
+		qd->corpus = "";
+		qd->corpus_size = 0;
+		return 0;
+	}
+	if (opt->map_quotes && !map_file(qd, fsize))
+		return 0;
 
-		ptr = realloc(quote_file_data.buffer, fsize + 1);
-		if (unlikely(!ptr)) {
-			journal("Unable to allocate memory for file buffer: %s.\n",
-				strerror(errno));
-			return -1;
-		}
-		quote_file_data.buffer = ptr;
-		quote_file_data.buf_length = fsize;
+	/* Allocate file buffer */
+	buffer = malloc(fsize);
+	if (unlikely(!buffer)) {
+		journal("Unable to allocate memory for file buffer: %s.\n",
+			strerror(errno));
+		return -1;
 	}
+	qd->region = buffer;
+	qd->corpus = buffer;
+	qd->corpus_size = fsize;
 
 	/* Read file data */
 	rewind(quotes_fh);
-	if (fread(quote_file_data.buffer, fsize, 1, quotes_fh) != 1) {
+	if (fread(buffer, fsize, 1, quotes_fh) != 1) {
 		journal("Unable to read from quotes file.\n");
 		return -1;
 	}
-	for (i = 0; i < fsize; i++) {
-		char *c;
+	return 0;
+}
 
-		c = &quote_file_data.buffer[i];
-		if (!*c)
-			*c = ' ';
+/* The offsets and lengths share one allocation */
+static int alloc_table(struct quote_data *qd, size_t length)
+{
+	qd->parsed = latency_alloc(2 * length * sizeof(uint32_t));
+	if (unlikely(!qd->parsed)) {
+		journal("Unable to allocate quotes array: %s.\n",
+			strerror(errno));
+		return -1;
 	}
-	quote_file_data.buffer[fsize] = '\0';
-	quote_file_data.buf_length = fsize;
+	qd->table.offsets = qd->parsed;
+	qd->table.lengths = qd->parsed + length;
+	qd->table.length = length;
+	return 0;
+}
 
-	/* Allocate the array of strings */
-	if (quote_file_data.length < 1) {
-		void *ptr;
+static int readquotes_file(struct quote_data *qd)
+{
+	if (alloc_table(qd, 1))
+		return -1;
 
-		ptr = realloc(quote_file_data.array, sizeof(char *));
-		if (unlikely(!ptr)) {
-			journal("Unable to allocate quotes array: %s.\n",
-				strerror(errno));
-			return -1;
-		}
-		quote_file_data.array = ptr;
-		quote_file_data.length = 1;
-	}
-	quote_file_data.array[0] = &quote_file_data.buffer[0];
+	qd->parsed[0] = 0;
+	qd->parsed[1] = qd->corpus_size;
 	return 0;
 }
 
-static int readquotes_line(void)
-{
-	unsigned int i, j;
-	size_t fsize, quotes;
+/*
+ * The line and percent parsers only record where each divider starts.
+ * Large files are split into chunks that are scanned on separate
+ * threads, and the dividers from each chunk are stitched back together
+ * in order afterwards.
+ */
 
-	fsize = get_file_size();
-	if (unlikely(fsize == (size_t)-1))
-		return -1;
+struct parse_chunk {
+	const char *corpus;
+	size_t corpus_size;
+	size_t begin, end;
 
-	/* Allocate file buffer */
-	if (fsize > quote_file_data.buf_length) {
+	size_t *dividers;
+	size_t length;
+	size_t capacity;
+
+	pthread_t thread;
+	unsigned has_percent : 1;
+	unsigned error       : 1;
+	unsigned threaded    : 1;
+};
+
+static int add_divider(struct parse_chunk *chunk, size_t pos)
+{
+	if (chunk->length == chunk->capacity) {
 		void *ptr;
+		size_t capacity;
 
-		ptr = realloc(quote_file_data.buffer, fsize + 1);
+		capacity = chunk->capacity ? chunk->capacity * 2 : 64;
+		ptr = realloc(chunk->dividers, capacity * sizeof(size_t));
 		if (unlikely(!ptr)) {
-			journal("Unable to allocate memory for file buffer: %s.\n",
-				strerror(errno));
-			quote_file_data.buf_length = 0;
+			chunk->error = 1;
 			return -1;
 		}
-		quote_file_data.buffer = ptr;
-		quote_file_data.buf_length = fsize;
+		chunk->dividers = ptr;
+		chunk->capacity = capacity;
 	}
 
-	/* Read file data */
-	rewind(quotes_fh);
-	if (fread(quote_file_data.buffer, fsize, 1, quotes_fh) != 1) {
-		journal("Unable to read from quotes file.\n");
-		return -1;
-	}
-	for (i = 0, quotes = 0; i < fsize; i++) {
-		char *c;
+	chunk->dividers[chunk->length++] = pos;
+	return 0;
+}
 
-		c = &quote_file_data.buffer[i];
-		switch (*c) {
-		case '\0':
-			*c = ' ';
+static void scan_lines(struct parse_chunk *chunk)
+{
+	size_t i;
+
+	for (i = chunk->begin; i < chunk->end; i++) {
+		i += scan_byte(chunk->corpus + i, chunk->end - i, '\n');
+		if (i == chunk->end)
 			break;
-		case '\n':
-			*c = '\0';
-			quotes++;
-		}
+		if (add_divider(chunk, i))
+			return;
 	}
+}
 
-	/*
-	 * Account for the fact that the last line doesn't
-	 * have a newline at the end.
-	 */
-	quotes++;
+/*
+ * Looks for "\n%\n" dividers. Only newlines can start a divider, so the
+ * scanner skips straight to each one and then looks at the next two
+ * bytes. A newline that directly follows another newline which did not
+ * start a divider can't start one either, so "\n\n%\n" is not split.
+ *
+ * Dividers that start before the end of the chunk belong to it, even if
+ * they run past the end.
+ */
+static void scan_percents(struct parse_chunk *chunk)
+{
+	const char *corpus;
+	size_t i, size;
 
-	/* Allocate the array of strings */
-	if (quotes > quote_file_data.length) {
-		void *ptr;
+	corpus = chunk->corpus;
+	size = chunk->corpus_size;
 
-		ptr = realloc(quote_file_data.array, quotes * sizeof(char *));
-		if (unlikely(!ptr)) {
-			journal("Unable to allocate quotes array: %s.\n",
-				strerror(errno));
-			return -1;
+	for (i = chunk->begin; i < chunk->end; ) {
+		i += scan_byte(corpus + i, chunk->end - i, '\n');
+		if (i == chunk->end || i + 1 >= size)
+			break;
+		if (corpus[i + 1] != '%') {
+			i += 2;
+			continue;
 		}
-		quote_file_data.array = ptr;
-		quote_file_data.length = quotes;
-	}
-	quote_file_data.array[0] = &quote_file_data.buffer[0];
-	for (i = 0, j = 1; i < fsize; i++) {
-		if (!quote_file_data.buffer[i]) {
-			assert(j < quotes);
-			quote_file_data.array[j++] = &quote_file_data.buffer[i + 1];
+
+		chunk->has_percent = 1;
+		if (i + 2 < size && corpus[i + 2] == '\n') {
+			if (add_divider(chunk, i))
+				return;
 		}
+		i += 3;
 	}
-	return 0;
 }
 
-static int readquotes_percent(void)
+static void *scan_chunk(void *arg)
 {
-	unsigned int i, j;
-	size_t fsize, quotes;
-	int watch, has_percent;
+	struct parse_chunk *chunk;
 
-	watch = 0;
-	quotes = 0;
-	has_percent = 0;
-	fsize = get_file_size();
-	if (unlikely(fsize == (size_t)-1))
-		return -1;
+	chunk = arg;
+	if (opt->linediv == DIV_PERCENT)
+		scan_percents(chunk);
+	else
+		scan_lines(chunk);
+	return NULL;
+}
 
-	/* Allocate file buffer */
-	if (fsize > quote_file_data.buf_length) {
-		void *ptr;
+/*
+ * Finds the first position at or after "pos" where the percent scanner
+ * can start without knowing what came before. That's any position after
+ * a byte that is neither a newline nor a percent sign, since those are
+ * the only bytes that can be part of an unfinished divider.
+ */
+static size_t chunk_start(const char *corpus, size_t size, size_t pos)
+{
+	if (opt->linediv != DIV_PERCENT)
+		return pos;
 
-		ptr = realloc(quote_file_data.buffer, fsize + 1);
-		if (unlikely(!ptr)) {
-			journal("Unable to allocate memory for file buffer: %s.\n", strerror(errno));
-			quote_file_data.buf_length = 0;
-			return -1;
-		}
+	for (; pos > 0 && pos < size; pos++) {
+		if (corpus[pos - 1] != '\n' && corpus[pos - 1] != '%')
+			break;
+	}
+	return pos;
+}
 
-		quote_file_data.buffer = ptr;
-		quote_file_data.buf_length = fsize;
+static unsigned int parser_threads(size_t size)
+{
+	long cpus;
+	size_t threads;
+
+	if (opt->parser_threads) {
+		threads = opt->parser_threads;
+	} else {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0) ? (size_t)cpus : 1;
 	}
 
-	/* Read file data */
-	rewind(quotes_fh);
-	if (fread(quote_file_data.buffer, fsize, 1, quotes_fh) != 1) {
-		journal("Unable to read from quotes file.\n");
-		return -1;
+	/* Small files aren't worth the overhead */
+	threads = MIN(threads, size / PARSE_CHUNK_MIN);
+	threads = MIN(threads, PARSER_THREADS_MAX);
+	return MAX(threads, 1);
+}
+
+static int readquotes_divided(struct quote_data *qd)
+{
+	struct parse_chunk chunks[PARSER_THREADS_MAX];
+	unsigned int i, threads;
+	size_t j, quotes, start, width;
+	uint32_t *offsets, *lengths;
+	int has_percent, ret;
+
+	threads = parser_threads(qd->corpus_size);
+	memset(chunks, 0, sizeof(chunks));
+	for (i = 0; i < threads; i++) {
+		chunks[i].corpus = qd->corpus;
+		chunks[i].corpus_size = qd->corpus_size;
+		chunks[i].begin = chunk_start(qd->corpus,
+					      qd->corpus_size,
+					      qd->corpus_size / threads * i);
+		if (i > 0) {
+			chunks[i].begin = MAX(chunks[i].begin, chunks[i - 1].begin);
+			chunks[i - 1].end = chunks[i].begin;
+		}
 	}
-	for (i = 0; i < fsize; i++) {
-		char *c;
-
-		c = &quote_file_data.buffer[i];
-		if (*c == '\0') {
-			*c = ' ';
-			watch = 0;
-		} else if (*c == '\n' && watch == 0) {
-			watch++;
-		} else if (*c == '%' && watch == 1) {
-			has_percent = 1;
-			watch++;
-		} else if (*c == '\n' && watch == 2) {
-			watch = 0;
-			*(c - 2) = '\0';
-			quotes++;
-		} else {
-			if (watch > 0)
-				watch = 0;
+	chunks[threads - 1].end = qd->corpus_size;
+
+	if (threads > 1)
+		journal("Parsing quotes file on %u threads.\n", threads);
+
+	/* The calling thread takes the first chunk */
+	for (i = 1; i < threads; i++) {
+		if (!pthread_create(&chunks[i].thread, NULL, scan_chunk, &chunks[i]))
+			chunks[i].threaded = 1;
+		else
+			scan_chunk(&chunks[i]);
+	}
+	scan_chunk(&chunks[0]);
+
+	ret = 0;
+	quotes = 1;
+	has_percent = 0;
+	for (i = 0; i < threads; i++) {
+		if (chunks[i].threaded)
+			pthread_join(chunks[i].thread, NULL);
+		if (chunks[i].error) {
+			journal("Unable to allocate quote dividers array.\n");
+			ret = -1;
 		}
+		has_percent |= chunks[i].has_percent;
+		quotes += chunks[i].length;
 	}
-	quote_file_data.buffer[fsize] = '\0';
 
-	if (!has_percent) {
+	if (ret)
+		goto end;
+	if (opt->linediv == DIV_PERCENT && !has_percent) {
 		journal("No dividing percent signs (%%) were found in the quotes file. This\n"
 			"means that the whole file will be treated as one quote, which is\n"
 			"probably not what you want. If this is what you want, use the `file'\n"
 			"option for `QuoteDivider' in the config file.\n");
-		return -1;
+		ret = -1;
+		goto end;
 	}
 
-	/* Allocate the array of strings */
-	if (quotes > quote_file_data.length) {
-		void *ptr;
+	/*
+	 * Each divider ends one quote and starts another, so the text after
+	 * the last divider is a quote too. If the file ends with a divider,
+	 * it is empty and is skipped when choosing which quote to send.
+	 */
+	ret = alloc_table(qd, quotes);
+	if (ret)
+		goto end;
 
-		ptr = realloc(quote_file_data.array, quotes * sizeof(char *));
-		if (unlikely(!ptr)) {
-			journal("Unable to allocate quotes array: %s.\n",
-				strerror(errno));
-			return -1;
-		}
-		quote_file_data.array = ptr;
-		quote_file_data.length = quotes;
-	}
-	quote_file_data.array[0] = &quote_file_data.buffer[0];
-	for (i = 0; i < fsize; i++) {
-		if (!quote_file_data.buffer[i]) {
-			i++;
-			break;
+	offsets = qd->parsed;
+	lengths = qd->parsed + qd->table.length;
+	width = (opt->linediv == DIV_PERCENT) ? 3 : 1;
+	quotes = 0;
+	start = 0;
+	for (i = 0; i < threads; i++) {
+		for (j = 0; j < chunks[i].length; j++) {
+			offsets[quotes] = start;
+			lengths[quotes] = chunks[i].dividers[j] - start;
+			start = chunks[i].dividers[j] + width;
+			quotes++;
 		}
 	}
-	j = 1;
-	for (; i < fsize; i++) {
-		if (!quote_file_data.buffer[i]) {
-			assert(j < quotes);
-			quote_file_data.array[j++] = &quote_file_data.buffer[i + 3];
-		}
+	offsets[quotes] = start;
+	lengths[quotes] = qd->corpus_size - start;
+
+end:
+	for (i = 0; i < threads; i++)
+		free(chunks[i].dividers);
+	return ret;
+}
+
+static void free_quote_data(struct quote_data *qd)
+{
+	if (qd->mapped)
+		munmap(qd->region, qd->corpus_size);
+	else
+		free(qd->region);
+	if (qd->file_fd >= 0)
+		close(qd->file_fd);
+
+	quote_index_unload(&qd->index);
+	free(qd->parsed);
+	free(qd->ids);
+	free(qd->responses);
+	free(qd->from_file);
+	free(qd->rendered);
+	memset(qd, 0, sizeof(*qd));
+}
+
+static int load_index(struct quote_data *qd)
+{
+	const char *path;
+
+	path = quote_index_path(opt);
+	if (!path || access(path, F_OK))
+		return -1;
+	if (opt->strict)
+		security_index_file_check(path);
+
+	if (quote_index_load(&qd->index,
+			     path,
+			     opt->linediv,
+			     qd->corpus,
+			     qd->corpus_size,
+			     fileno(quotes_fh),
+			     opt->verify_index)) {
+		journal("Not using quotes index \"%s\", parsing the quotes file instead.\n", path);
+		return -1;
 	}
+
+	journal("Using quotes index \"%s\".\n", path);
+	qd->table = qd->index.table;
 	return 0;
 }
 
-/* Externals */
-
-int open_quotes_file(const struct options *const local_opt)
+/*
+ * Parses the quotes file into a fresh set of buffers and only replaces
+ * the live data if that succeeds, so a bad reload keeps serving the
+ * previous quotes. The request path never touches the file.
+ *
+ * If there is an up-to-date quotes index, it is used instead and no
+ * parsing happens at all.
+ */
+static int load_quotes(struct quote_data *qd, int use_index)
 {
-	if (local_opt)
-		opt = local_opt;
+	int (*readquotes)(struct quote_data *);
 
-	if (quotes_fh) {
-		journal("Internal error: quotes file handle is already open\n");
+	switch (opt->linediv) {
+	case DIV_EVERYLINE:
+	case DIV_PERCENT:
+		readquotes = readquotes_divided;
+		break;
+	case DIV_WHOLEFILE:
+		readquotes = readquotes_file;
+		break;
+	default:
+		JTRACE();
+		journal("Internal error: invalid enum value for quote_divider: %d.\n", opt->linediv);
 		cleanup(EXIT_INTERNAL, 1);
+		return -1;
 	}
+
+	memset(qd, 0, sizeof(*qd));
+	qd->file_fd = -1;
+	if (read_file(qd))
+		goto fail;
+	if (!use_index || load_index(qd)) {
+		journal("Parsing quotes file using the %s scanner.\n", scan_kernel_name());
+		if (readquotes(qd))
+			goto fail;
+	}
+
+#if DEBUG
+	print_quotes(qd);
+#endif /* DEBUG */
+
+	if (qd->table.length > UINT32_MAX) {
+		journal("Quotes file has more than %lu quotes, which is too many.\n",
+			(unsigned long)UINT32_MAX);
+		goto fail;
+	}
+
+	journal("Loaded %lu quote%s from %s quotes file.\n",
+		(unsigned long)qd->table.length,
+		PLURAL(qd->table.length),
+		qd->mapped ? "mapped" : "buffered");
+	return 0;
+
+fail:
+	free_quote_data(qd);
+	return -1;
+}
+
+static int open_file(void)
+{
 	if (opt->strict)
 		security_quotes_file_check(opt->quotes_file);
 
@@ -451,6 +999,79 @@ int open_quotes_file(const struct options *const local_opt)
 	return 0;
 }
 
+/*
+ * Waits until no reader can still be using quotes that were replaced
+ * before this was called. Must not be called by an online reader.
+ */
+static void wait_for_readers(void)
+{
+	struct timespec pause;
+	unsigned long epoch, seen;
+	unsigned int i, count;
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = 1000 * 1000;
+
+	ATOMIC_FENCE();
+	epoch = ATOMIC_ADD(reader_epoch, 1);
+	ATOMIC_FENCE();
+
+	count = MIN(ATOMIC_LOAD(reader_count), MAX_WORKERS);
+	for (i = 0; i < count; i++) {
+		for (;;) {
+			seen = ATOMIC_LOAD(readers[i].epoch);
+			if (seen == 0 || seen >= epoch)
+				break;
+			nanosleep(&pause, NULL);
+		}
+	}
+}
+
+/* Externals */
+
+int open_quotes_file(const struct options *const local_opt)
+{
+	struct quote_data qd, *live, *old;
+
+	if (local_opt)
+		opt = local_opt;
+
+	if (quotes_fh) {
+		journal("Internal error: quotes file handle is already open\n");
+		cleanup(EXIT_INTERNAL, 1);
+	}
+	scan_init();
+	if (open_file() || load_quotes(&qd, 1))
+		return -1;
+	if (render_quotes(&qd)) {
+		free_quote_data(&qd);
+		return -1;
+	}
+
+	live = malloc(sizeof(struct quote_data));
+	if (unlikely(!live)) {
+		journal("Unable to allocate quote data: %s.\n", strerror(errno));
+		free_quote_data(&qd);
+		return -1;
+	}
+	*live = qd;
+	live->refs = 1;
+
+	/* The daily timer may be looking at the old quotes */
+	pthread_mutex_lock(&daily_lock);
+	if (opt->is_daily) {
+		daily.valid = 0;
+		daily_refresh(live);
+	}
+	old = quote_file_data;
+	ATOMIC_STORE(quote_file_data, live);
+	pthread_mutex_unlock(&daily_lock);
+
+	wait_for_readers();
+	release_quotes(old);
+	return 0;
+}
+
 int reopen_quotes_file(void)
 {
 	FILE *old_fh;
@@ -460,6 +1081,8 @@ int reopen_quotes_file(void)
 	if (open_quotes_file(NULL)) {
 		/* Replace old quotes file */
 		JTRACE();
+		if (quotes_fh)
+			fclose(quotes_fh);
 		quotes_fh = old_fh;
 		return -1;
 	}
@@ -475,50 +1098,192 @@ void close_quotes_file(void)
 		fclose(quotes_fh);
 }
 
-void destroy_quote_buffers(void)
+int build_quotes_index(const struct options *const local_opt)
 {
-	FINAL_FREE(quote_file_data.array);
-	FINAL_FREE(quote_file_data.buffer);
-	FINAL_FREE(quote_buffer.data);
+	struct quote_data qd;
+	const char *path;
+	int ret;
+
+	opt = local_opt;
+	path = quote_index_path(opt);
+	if (!path) {
+		journal("No quotes index file is configured.\n");
+		return -1;
+	}
+	scan_init();
+	if (open_file() || load_quotes(&qd, 0))
+		return -1;
+
+	ret = quote_index_save(path,
+			       opt->linediv,
+			       qd.corpus,
+			       qd.corpus_size,
+			       fileno(quotes_fh),
+			       &qd.table);
+	if (!ret)
+		journal("Wrote index of %lu quote%s to \"%s\".\n",
+			(unsigned long)qd.table.length,
+			PLURAL(qd.table.length),
+			path);
+
+	free_quote_data(&qd);
+	return ret;
 }
 
-int get_quote_of_the_day(const char **const buffer, size_t *const length)
+int start_quotes_timer(void)
 {
-	int (*readquotes)(void);
+	sigset_t all, old;
+	int ret;
 
-	seed_randgen();
-	switch (opt->linediv) {
-	case DIV_EVERYLINE:
-		readquotes = readquotes_line;
-		break;
-	case DIV_PERCENT:
-		readquotes = readquotes_percent;
-		break;
-	case DIV_WHOLEFILE:
-		readquotes = readquotes_file;
-		break;
-	default:
-		JTRACE();
-		journal("Internal error: invalid enum value for quote_divider: %d.\n", opt->linediv);
-		cleanup(EXIT_INTERNAL, 1);
+	if (!opt->is_daily || daily.running)
+		return 0;
+
+	/* Leave signal handling to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&daily.thread, NULL, daily_timer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		journal("Unable to start daily quote timer: %s.\n", strerror(ret));
 		return -1;
 	}
+	daily.running = 1;
+	return 0;
+}
+
+void destroy_quote_buffers(void)
+{
+	/*
+	 * If the daily timer is busy with the quotes, we're exiting from a
+	 * signal handler in the middle of a reload. Just let them leak.
+	 */
+	if (pthread_mutex_trylock(&daily_lock))
+		return;
 
-	if (readquotes()) {
+	/* Likewise if other threads may still be sending them */
+	if (reader_count > 1)
+		return;
+
+	release_quotes(quote_file_data);
+	quote_file_data = NULL;
+}
+
+int register_quote_reader(void)
+{
+	const unsigned int slot = ATOMIC_ADD(reader_count, 1) - 1;
+
+	if (slot >= MAX_WORKERS) {
+		journal("Internal error: too many quote readers.\n");
 		return -1;
 	}
-	if (quote_file_data.length == 0) {
-		journal("Quotes file is empty.\n");
+	reader = &readers[slot];
+	return 0;
+}
+
+void quotes_online(void)
+{
+	if (!reader)
+		return;
+
+	ATOMIC_STORE(reader->epoch, ATOMIC_LOAD(reader_epoch));
+	ATOMIC_FENCE();
+	reading = ATOMIC_LOAD(quote_file_data);
+}
+
+void quotes_offline(void)
+{
+	if (!reader)
+		return;
+
+	reading = NULL;
+	ATOMIC_STORE(reader->epoch, 0);
+}
+
+/* The quotes that get_quote_of_the_day() is currently answering from */
+const struct quote_data *current_quotes(void)
+{
+	return reading ? reading : ATOMIC_LOAD(quote_file_data);
+}
+
+/* The buffer that every response from these quotes points into */
+void rendered_quotes(const struct quote_data *qd,
+		     const char **const base,
+		     size_t *const size)
+{
+	*base = qd->rendered;
+	*size = qd->rendered_size;
+}
+
+/*
+ * Keeps the current quotes alive past a reload, for a response that is
+ * still being sent. The buffer from get_quote_of_the_day() stays valid
+ * until the matching release_quotes().
+ */
+struct quote_data *hold_quotes(void)
+{
+	struct quote_data *qd;
+
+	qd = reading ? reading : ATOMIC_LOAD(quote_file_data);
+	ATOMIC_ADD(qd->refs, 1);
+	return qd;
+}
+
+void release_quotes(struct quote_data *qd)
+{
+	if (!qd || ATOMIC_SUB(qd->refs, 1) > 0)
+		return;
+
+	free_quote_data(qd);
+	free(qd);
+}
+
+int get_quote_of_the_day(const char **const buffer, size_t *const length)
+{
+	const struct quote_data *qd;
+	size_t choice;
+
+	qd = reading ? reading : ATOMIC_LOAD(quote_file_data);
+	if (pick_quote(qd, &choice))
+		return -1;
+	return send_quote(qd, choice, buffer, length);
+}
+
+/*
+ * Like get_quote_of_the_day(), but a large quote comes back as a span
+ * of the quotes file, with its padding either side, for sendfile().
+ */
+int get_quote_span(struct quote_span *const span)
+{
+	const struct quote_data *qd;
+	const struct response *response;
+	size_t choice, id, head;
+
+	qd = reading ? reading : ATOMIC_LOAD(quote_file_data);
+	if (pick_quote(qd, &choice))
 		return -1;
+
+	if (!SENT_FROM_FILE(qd, choice)) {
+		span->fd = -1;
+		span->length = 0;
+		span->tail_length = 0;
+		return send_quote(qd, choice, &span->head, &span->head_length);
 	}
 
 #if DEBUG
-	print_quotes();
+	journal("Sending quotation #%lu from the quotes file.\n",
+		(unsigned long)qd->ids[choice]);
 #endif /* DEBUG */
 
-	if (format_quote())
-		return -1;
-	*buffer = quote_buffer.data;
-	*length = quote_buffer.str_length;
+	id = qd->ids[choice];
+	response = &qd->responses[choice];
+	head = opt->pad_quotes ? 1 : 0;
+	span->head = qd->rendered + response->offset;
+	span->head_length = head;
+	span->fd = qd->file_fd;
+	span->offset = (off_t)qd->table.offsets[id];
+	span->length = qd->table.lengths[id];
+	span->tail = span->head + response->length - 2 * head;
+	span->tail_length = 2 * head;
 	return 0;
 }
@@ -21,15 +21,43 @@
 #ifndef _QUOTES_H_
 #define _QUOTES_H_
 
+#include <sys/types.h>
 #include <stddef.h>
 
 #include "config.h"
 
+struct quote_data;
+
+/* A response that may be partly sent straight from the quotes file */
+struct quote_span {
+	const char *head;		/* sent first, from memory */
+	size_t head_length;
+	int fd;				/* the quotes file, or -1 if there is nothing from it */
+	off_t offset;
+	size_t length;
+	const char *tail;		/* sent last, from memory */
+	size_t tail_length;
+};
+
 int open_quotes_file(const struct options *opt);
 int reopen_quotes_file(void);
 void close_quotes_file(void);
 
+int build_quotes_index(const struct options *opt);
+int start_quotes_timer(void);
+
 void destroy_quote_buffers(void);
 int get_quote_of_the_day(const char **buffer, size_t *length);
+int get_quote_span(struct quote_span *span);
+
+int register_quote_reader(void);
+void quotes_online(void);
+void quotes_offline(void);
+
+const struct quote_data *current_quotes(void);
+void rendered_quotes(const struct quote_data *qd, const char **base, size_t *size);
+
+struct quote_data *hold_quotes(void);
+void release_quotes(struct quote_data *qd);
 
 #endif /* _QUOTES_H_ */
@@ -0,0 +1,242 @@
+/*
+ * ratelimit.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core.h"
+#include "journal.h"
+#include "ratelimit.h"
+#include "rng.h"
+
+/*
+ * Requests are limited with a token bucket for each source prefix. The
+ * buckets live in a fixed table of 2^17 slots, grouped into sets of four
+ * that share a cache line. Each slot is a single 64-bit word, updated
+ * with compare-and-swap, holding:
+ *
+ *   tag    (12 bits)  which prefix owns the slot, or 0 if it is empty
+ *   time   (32 bits)  when the bucket was last refilled, from clock_ms()
+ *   tokens (20 bits)  how full the bucket is, in sixteenths of a token
+ *
+ * The time is as wide as the clock, so it wraps with it, every 49.7
+ * days. Only a bucket left untouched for close to a multiple of that
+ * could look more recently used than it is.
+ *
+ * A prefix without a slot may only take one whose bucket would have
+ * refilled completely by now, which is no different from a fresh one.
+ * When every slot in its set is busy, the request is refused. A flood
+ * from spoofed sources therefore can't push out the prefixes being
+ * limited, and never allocates any memory.
+ */
+
+#define RATELIMIT_SLOTS			(1 << 17)
+#define RATELIMIT_WAYS			4
+
+#define TOKEN_SCALE			16
+#define TOKENS_BITS			20
+#define TIME_BITS			32
+#define TAG_BITS			12
+
+/* Workers read the clock once per batch, so theirs may be a little behind */
+#define CLOCK_SKEW			4096
+
+#define TOKENS_MASK			((UINT64_C(1) << TOKENS_BITS) - 1)
+#define TIME_MASK			((UINT64_C(1) << TIME_BITS) - 1)
+#define TAG_MASK			((UINT64_C(1) << TAG_BITS) - 1)
+
+#define SLOT(tag,time,tokens)		(((uint64_t)(tag) << (TIME_BITS + TOKENS_BITS)) | \
+					 ((uint64_t)((time) & TIME_MASK) << TOKENS_BITS) | \
+					 (uint64_t)(tokens))
+#define SLOT_TAG(s)			((uint32_t)((s) >> (TIME_BITS + TOKENS_BITS)))
+#define SLOT_TIME(s)			((uint32_t)(((s) >> TOKENS_BITS) & TIME_MASK))
+#define SLOT_TOKENS(s)			((uint32_t)((s) & TOKENS_MASK))
+
+static uint64_t *slots;			/* aligned so that each set is in one cache line */
+static uint64_t seed;
+static uint32_t rate, capacity;
+static unsigned int prefix4, prefix6;
+
+static uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= UINT64_C(0xbf58476d1ce4e5b9);
+	x ^= x >> 27;
+	x *= UINT64_C(0x94d049bb133111eb);
+	x ^= x >> 31;
+	return x;
+}
+
+int ratelimit_init(const struct options *opt)
+{
+	uint64_t *table;
+	uint32_t burst;
+
+	if (opt->rate_limit == 0)
+		return 0;
+
+	burst = opt->rate_limit_burst ? opt->rate_limit_burst : opt->rate_limit;
+	rate = opt->rate_limit;
+	capacity = MIN(burst * TOKEN_SCALE, (uint32_t)TOKENS_MASK);
+	prefix4 = opt->rate_limit_prefix4;
+	prefix6 = opt->rate_limit_prefix6;
+
+	/* Keyed, so that nobody can choose sources that collide */
+	seed = rng_entropy();
+	table = calloc(RATELIMIT_SLOTS + CACHE_LINE_SIZE / sizeof(uint64_t), sizeof(uint64_t));
+	if (unlikely(!table)) {
+		journal("Unable to allocate rate limiting table: %s.\n", strerror(errno));
+		return -1;
+	}
+
+	/* The table lives as long as the daemon, so the start needn't be kept */
+	slots = (uint64_t *)(((uintptr_t)table + CACHE_LINE_SIZE - 1) &
+			     ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+	return 0;
+}
+
+int ratelimit_enabled(void)
+{
+	return slots != NULL;
+}
+
+static uint64_t hash_bytes(const unsigned char *bytes, unsigned int bits, uint64_t h)
+{
+	uint64_t word;
+	unsigned int i;
+
+	word = 0;
+	for (i = 0; i < (bits + 7) / 8; i++) {
+		unsigned char byte = bytes[i];
+
+		if (bits < (i + 1) * 8)
+			byte &= (unsigned char)(0xff << ((i + 1) * 8 - bits));
+		word = (word << 8) | byte;
+		if (i % 8 == 7) {
+			h = mix64(h ^ word);
+			word = 0;
+		}
+	}
+	return mix64(h ^ word ^ bits);
+}
+
+/* Hashes the source's prefix, treating IPv4-mapped addresses as IPv4 */
+static uint64_t hash_prefix(const struct sockaddr_storage *addr)
+{
+	static const unsigned char mapped[12] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+	};
+
+	if (addr->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+		const unsigned char *bytes = sin6->sin6_addr.s6_addr;
+
+		if (memcmp(bytes, mapped, sizeof(mapped)))
+			return hash_bytes(bytes, prefix6, seed ^ 6);
+		return hash_bytes(bytes + sizeof(mapped), prefix4, seed ^ 4);
+	} else {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+
+		return hash_bytes((const unsigned char *)&sin->sin_addr, prefix4, seed ^ 4);
+	}
+}
+
+/* How many tokens a bucket has by "now", and when it was last refilled */
+static uint32_t refill(uint64_t slot, uint32_t now, uint32_t *time)
+{
+	uint32_t elapsed;
+	uint64_t added;
+
+	*time = SLOT_TIME(slot);
+	if (((*time - now) & TIME_MASK) < CLOCK_SKEW)
+		return SLOT_TOKENS(slot);
+
+	elapsed = (now - *time) & TIME_MASK;
+	added = (uint64_t)elapsed * rate * TOKEN_SCALE / 1000;
+	if (SLOT_TOKENS(slot) + added >= capacity) {
+		*time = now;
+		return capacity;
+	}
+
+	/* Only move the clock on by what was added, so no fraction is lost */
+	*time += (uint32_t)(added * 1000 / ((uint64_t)rate * TOKEN_SCALE));
+	return SLOT_TOKENS(slot) + (uint32_t)added;
+}
+
+int ratelimit_allow(const struct sockaddr_storage *addr, uint32_t now)
+{
+	uint64_t *set;
+	uint64_t h, old;
+	uint32_t tag, tokens, time;
+	unsigned int i;
+
+	/* Local clients, over Unix sockets, aren't limited */
+	if (!slots || (addr->ss_family != AF_INET && addr->ss_family != AF_INET6))
+		return 1;
+
+	h = hash_prefix(addr);
+	set = &slots[h & (RATELIMIT_SLOTS - RATELIMIT_WAYS)];
+	tag = (uint32_t)((h >> 40) & TAG_MASK) | 1;
+
+retry:
+	for (i = 0; i < RATELIMIT_WAYS; i++) {
+		old = ATOMIC_LOAD(set[i]);
+		if (SLOT_TAG(old) != tag)
+			continue;
+
+		tokens = refill(old, now, &time);
+		if (tokens < TOKEN_SCALE)
+			return 0;
+		if (!ATOMIC_CAS(set[i], old, SLOT(tag, time, tokens - TOKEN_SCALE)))
+			goto retry;
+		return 1;
+	}
+
+	for (i = 0; i < RATELIMIT_WAYS; i++) {
+		old = ATOMIC_LOAD(set[i]);
+		if (old && refill(old, now, &time) < capacity)
+			continue;
+
+		if (!ATOMIC_CAS(set[i], old, SLOT(tag, now, capacity - TOKEN_SCALE)))
+			goto retry;
+		return 1;
+	}
+	return 0;
+}
+
+/* For sockets accepted without their peer's address */
+int ratelimit_allow_socket(int sockfd, uint32_t now)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+
+	if (!slots)
+		return 1;
+
+	len = sizeof(addr);
+	if (getpeername(sockfd, (struct sockaddr *)&addr, &len))
+		return 0;
+	return ratelimit_allow(&addr, now);
+}
@@ -0,0 +1,35 @@
+/*
+ * ratelimit.h
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <sys/socket.h>
+#include <stdint.h>
+
+#include "config.h"
+
+int ratelimit_init(const struct options *opt);
+int ratelimit_enabled(void);
+
+int ratelimit_allow(const struct sockaddr_storage *addr, uint32_t now);
+int ratelimit_allow_socket(int sockfd, uint32_t now);
+
+#endif /* _RATELIMIT_H_ */
@@ -0,0 +1,108 @@
+/*
+ * rng.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "rng.h"
+
+#define PCG_MULTIPLIER		UINT64_C(6364136223846793005)
+
+void rng_seed(struct rng *rng, uint64_t seed, uint64_t sequence)
+{
+	rng->state = 0;
+	rng->inc = (sequence << 1) | 1;
+	rng_next(rng);
+	rng->state += seed;
+	rng_next(rng);
+}
+
+/* splitmix64, to spread the fallback sources over all the bits */
+static uint64_t mix64(uint64_t x)
+{
+	x += UINT64_C(0x9e3779b97f4a7c15);
+	x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return x ^ (x >> 31);
+}
+
+/*
+ * Gets a seed from the kernel, or failing that, from the time, the
+ * process id, and the address of a local variable, which differs
+ * between threads.
+ */
+uint64_t rng_entropy(void)
+{
+	struct timeval tv;
+	uint64_t seed;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		const ssize_t bytes = read(fd, &seed, sizeof(seed));
+
+		close(fd);
+		if (bytes == sizeof(seed))
+			return seed;
+	}
+
+	gettimeofday(&tv, NULL);
+	seed = mix64((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+	seed = mix64(seed ^ (uint64_t)getpid());
+	seed = mix64(seed ^ (uint64_t)(size_t)&seed);
+	return seed;
+}
+
+uint32_t rng_next(struct rng *rng)
+{
+	uint64_t old;
+	uint32_t xorshifted, rot;
+
+	old = rng->state;
+	rng->state = old * PCG_MULTIPLIER + rng->inc;
+	xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+	rot = (uint32_t)(old >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/*
+ * Returns a uniformly distributed number in [0, bound), using Lemire's
+ * multiply-and-reject method. It only divides in the rare case where
+ * the first product lands in the biased range.
+ */
+uint32_t rng_bounded(struct rng *rng, uint32_t bound)
+{
+	uint64_t product;
+	uint32_t low;
+
+	product = (uint64_t)rng_next(rng) * bound;
+	low = (uint32_t)product;
+	if (unlikely(low < bound)) {
+		const uint32_t threshold = -bound % bound;
+
+		while (low < threshold) {
+			product = (uint64_t)rng_next(rng) * bound;
+			low = (uint32_t)product;
+		}
+	}
+	return (uint32_t)(product >> 32);
+}
@@ -0,0 +1,38 @@
+/*
+ * rng.h
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RNG_H_
+#define _RNG_H_
+
+#include <stdint.h>
+
+/* PCG32 generator state. Not safe to share between threads. */
+struct rng {
+	uint64_t state;
+	uint64_t inc;
+};
+
+void rng_seed(struct rng *rng, uint64_t seed, uint64_t sequence);
+uint64_t rng_entropy(void);
+
+uint32_t rng_next(struct rng *rng);
+uint32_t rng_bounded(struct rng *rng, uint32_t bound);
+
+#endif /* _RNG_H_ */
@@ -0,0 +1,112 @@
+/*
+ * scan.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+
+#include "core.h"
+#include "scan.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_KERNELS	1
+# include <immintrin.h>
+#else
+# define HAVE_X86_KERNELS	0
+#endif
+
+typedef size_t (*scan_kernel)(const char *buf, size_t length, char ch);
+
+static size_t scan_byte_scalar(const char *buf, size_t length, char ch)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		if (buf[i] == ch)
+			break;
+	}
+	return i;
+}
+
+/*
+ * Set by scan_init(), which has to run before any parser threads are
+ * started, since they read it without synchronisation. Until then the
+ * scalar kernel is used.
+ */
+static scan_kernel kernel = scan_byte_scalar;
+static const char *kernel_name = "scalar";
+
+#if HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static size_t scan_byte_sse2(const char *buf, size_t length, char ch)
+{
+	const __m128i needle = _mm_set1_epi8(ch);
+	size_t i;
+
+	for (i = 0; i + 16 <= length; i += 16) {
+		const __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+		const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scan_byte_scalar(buf + i, length - i, ch);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_byte_avx2(const char *buf, size_t length, char ch)
+{
+	const __m256i needle = _mm256_set1_epi8(ch);
+	size_t i;
+
+	for (i = 0; i + 32 <= length; i += 32) {
+		const __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+		const unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scan_byte_sse2(buf + i, length - i, ch);
+}
+#endif /* HAVE_X86_KERNELS */
+
+/* Picks the widest kernel this CPU supports */
+void scan_init(void)
+{
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernel = scan_byte_avx2;
+		kernel_name = "AVX2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		kernel = scan_byte_sse2;
+		kernel_name = "SSE2";
+	}
+#endif /* HAVE_X86_KERNELS */
+}
+
+size_t scan_byte(const char *buf, size_t length, char ch)
+{
+	return kernel(buf, length, ch);
+}
+
+const char *scan_kernel_name(void)
+{
+	return kernel_name;
+}
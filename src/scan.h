@@ -0,0 +1,35 @@
+/*
+ * scan.h
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+/*
+ * Returns the index of the first occurrence of "ch" in the first
+ * "length" bytes of "buf", or "length" if there is none.
+ */
+size_t scan_byte(const char *buf, size_t length, char ch);
+
+void scan_init(void);
+const char *scan_kernel_name(void);
+
+#endif /* _SCAN_H_ */
@@ -35,5 +35,6 @@ void security_file_check(const char *path, const char *file_type);
 
 # define security_conf_file_check(path)		security_file_check((path), "configuration")
 # define security_quotes_file_check(path)	security_file_check((path), "quotes")
+# define security_index_file_check(path)	security_file_check((path), "quotes index")
 
 #endif /* _SECURITY_H_ */
@@ -22,9 +22,12 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "core.h"
 #include "daemon.h"
 #include "journal.h"
+#include "latency.h"
 #include "quotes.h"
 #include "signal_hndl.h"
 
@@ -36,6 +39,8 @@
 			fputs((x), stderr);	\
 	} while (0)
 
+static volatile sig_atomic_t reload_requested;
+
 static void handle_signal(const int signum)
 {
 	switch (signum) {
@@ -52,20 +57,49 @@ static void handle_signal(const int signum)
 		cleanup(EXIT_SIGNAL, 1);
 		break;
 	case SIGHUP:
+		/* The quotes are reloaded from the main loop, see check_reload() */
 		JOURNAL("Hangup recieved. Loading new quotes...\n");
-		if (reopen_quotes_file())
-			JOURNAL("Error reopening quotes file!\n");
+		reload_requested = 1;
 		break;
 	case SIGCHLD:
 		JOURNAL("My child died. Doing nothing.\n");
 	}
 }
 
+static void set_handler(const int signum)
+{
+	struct sigaction act;
+
+	/*
+	 * No SA_RESTART, so that a blocking accept() or recvfrom() is
+	 * interrupted and the main loop gets to act on a pending reload.
+	 */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = handle_signal;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	sigaction(signum, &act, NULL);
+}
+
 void signal_hndl_init(void)
 {
-	signal(SIGSEGV, handle_signal);
-	signal(SIGTERM, handle_signal);
-	signal(SIGINT,  handle_signal);
-	signal(SIGHUP,  handle_signal);
-	signal(SIGCHLD, handle_signal);
+	set_handler(SIGSEGV);
+	set_handler(SIGTERM);
+	set_handler(SIGINT);
+	set_handler(SIGHUP);
+	set_handler(SIGCHLD);
+}
+
+void check_reload(void)
+{
+	if (likely(!reload_requested))
+		return;
+
+	reload_requested = 0;
+
+	/* Parsing the new quotes mustn't hold up anything else on this CPU */
+	latency_set_realtime(0);
+	if (reopen_quotes_file())
+		journal("Error reopening quotes file!\n");
+	latency_set_realtime(1);
 }
@@ -22,5 +22,6 @@
 #define _SIGNAL_HNDL_H_
 
 void signal_hndl_init(void);
+void check_reload(void);
 
 #endif /* _SIGNAL_HNDL_H_ */
@@ -0,0 +1,111 @@
+/*
+ * timer_wheel.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+#define TICK(ms)			((ms) >> TIMER_TICK_SHIFT)
+
+void timer_wheel_init(struct timer_wheel *wheel, uint32_t now)
+{
+	unsigned int i;
+
+	for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		wheel->slots[i] = NULL;
+	wheel->tick = TICK(now);
+	wheel->count = 0;
+}
+
+void timer_set(struct timer_wheel *wheel, struct timer *timer, uint32_t expires)
+{
+	struct timer **slot;
+
+	timer_clear(wheel, timer);
+
+	/* A time that has been passed already goes in the next slot to be run */
+	timer->expires = expires;
+	if (!TIME_AFTER_EQ(expires, wheel->tick << TIMER_TICK_SHIFT))
+		expires = wheel->tick << TIMER_TICK_SHIFT;
+
+	slot = &wheel->slots[TICK(expires) & (TIMER_WHEEL_SLOTS - 1)];
+	timer->next = *slot;
+	timer->pprev = slot;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	*slot = timer;
+	wheel->count++;
+}
+
+void timer_clear(struct timer_wheel *wheel, struct timer *timer)
+{
+	if (!timer->pprev)
+		return;
+
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+	wheel->count--;
+}
+
+/*
+ * Calls "expired" for every timer that is due by "now", after clearing
+ * it, passing "arg" along. The callback may set the timer again or free it, but mustn't
+ * clear any other timer.
+ */
+void timer_wheel_run(struct timer_wheel *wheel,
+		     uint32_t now,
+		     timer_expired expired,
+		     void *arg)
+{
+	struct timer *timer, *next;
+	uint32_t tick, ticks;
+
+	ticks = TICK(now) - wheel->tick;
+	if (wheel->count == 0) {
+		wheel->tick = TICK(now);
+		return;
+	}
+
+	/* Once round the wheel is as far as anything can be due */
+	if (ticks >= TIMER_WHEEL_SLOTS)
+		ticks = TIMER_WHEEL_SLOTS - 1;
+
+	for (tick = TICK(now) - ticks; tick != TICK(now) + 1; tick++) {
+		timer = wheel->slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+		for (; timer; timer = next) {
+			next = timer->next;
+			if (!TIME_AFTER_EQ(now, timer->expires))
+				continue;
+
+			/* Whatever the callback does, the next timer stays put */
+			timer_clear(wheel, timer);
+			expired(timer, arg);
+		}
+	}
+	wheel->tick = TICK(now);
+}
+
+/* How long to wait before the wheel next needs running, in milliseconds */
+int timer_wheel_timeout(const struct timer_wheel *wheel)
+{
+	return wheel->count ? TIMER_TICK_MS : -1;
+}
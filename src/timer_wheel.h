@@ -0,0 +1,66 @@
+/*
+ * timer_wheel.h
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+#include "core.h"
+
+/* Must be a power of two */
+#define TIMER_WHEEL_SLOTS		1024
+#define TIMER_TICK_SHIFT		7 /* 128ms */
+#define TIMER_TICK_MS			(1 << TIMER_TICK_SHIFT)
+
+/*
+ * A hashed timer wheel, as described by Varghese and Lauck. Each timer
+ * is kept in the slot for the tick it expires on, modulo the size of
+ * the wheel, so adding and removing one takes constant time, and each
+ * tick only looks at the timers in one slot. Timers further away than
+ * one turn of the wheel are passed over until their turn comes round.
+ *
+ * Timers are embedded in whatever they time, and times are in
+ * milliseconds from clock_ms().
+ */
+struct timer {
+	struct timer *next;
+	struct timer **pprev;			/* what points to this timer, or NULL if it isn't set */
+	uint32_t expires;
+};
+
+struct timer_wheel {
+	struct timer *slots[TIMER_WHEEL_SLOTS];
+	uint32_t tick;				/* the last tick that was run */
+	unsigned long count;
+};
+
+typedef void (*timer_expired)(struct timer *timer, void *arg);
+
+void timer_wheel_init(struct timer_wheel *wheel, uint32_t now);
+void timer_set(struct timer_wheel *wheel, struct timer *timer, uint32_t expires);
+void timer_clear(struct timer_wheel *wheel, struct timer *timer);
+void timer_wheel_run(struct timer_wheel *wheel,
+		     uint32_t now,
+		     timer_expired expired,
+		     void *arg);
+int timer_wheel_timeout(const struct timer_wheel *wheel);
+
+#endif /* _TIMER_WHEEL_H_ */
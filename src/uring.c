@@ -0,0 +1,548 @@
+/*
+ * uring.c
+ *
+ * qotd - A simple QOTD daemon.
+ * Copyright (c) 2015-2016 Emmie Smith
+ *
+ * qotd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * qotd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with qotd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__)
+# define _GNU_SOURCE
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/uio.h>
+#endif /* __linux__ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "core.h"
+#include "daemon.h"
+#include "journal.h"
+#include "quotes.h"
+#include "ratelimit.h"
+#include "uring.h"
+
+#if defined(__linux__) && defined(IORING_ACCEPT_MULTISHOT) && \
+    defined(IORING_CQE_F_NOTIF) && defined(IOSQE_CQE_SKIP_SUCCESS)
+
+#define URING_ENTRIES			1024
+#define URING_HOLDS			256
+
+/*
+ * Each request's user data says what it was, which quotes it is
+ * sending from, and which connection it is for.
+ */
+#define USER_DATA(op,hold,fd)		(((uint64_t)(op) << 40) | \
+					 ((uint64_t)(hold) << 32) | \
+					 (uint32_t)(fd))
+#define USER_OP(data)			((unsigned int)((data) >> 40))
+#define USER_HOLD(data)			((unsigned int)(((data) >> 32) & 0xff))
+
+enum {
+	OP_ACCEPT = 1,
+	OP_SEND,
+	OP_TIMEOUT,
+	OP_CLOSE
+};
+
+/*
+ * Sends point straight into the rendered quotes, so the quotes they
+ * come from are held until every send from them has completed.
+ */
+struct uring_hold {
+	struct quote_data *quotes;
+	unsigned long inflight;
+	int registered;
+};
+
+struct uring {
+	int fd;
+	int listen_fd;
+
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head, *sq_tail, *sq_array;
+	unsigned int sq_mask, sq_entries, sq_local_tail;
+
+	unsigned int *cq_head, *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct uring_hold holds[URING_HOLDS];
+	unsigned int hold;
+	unsigned long inflight;
+
+	struct admission admission;
+	struct __kernel_timespec timeout;
+
+	unsigned starved   : 1;
+	unsigned accepting : 1;
+	unsigned multishot : 1;
+	unsigned skip_cqe  : 1;
+	unsigned fixed     : 1;
+	unsigned registered: 1;
+	unsigned timed     : 1;
+};
+
+/* There is no libc wrapper for these */
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd,
+			  unsigned int to_submit,
+			  unsigned int min_complete,
+			  unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd,
+			     unsigned int opcode,
+			     const void *arg,
+			     unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int map_rings(struct uring *r, const struct io_uring_params *params)
+{
+	const size_t sq_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+	const size_t cq_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+	unsigned int i;
+	char *ring;
+
+	r->ring_size = MAX(sq_size, cq_size);
+	r->ring = mmap(NULL, r->ring_size,
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQ_RING);
+	if (r->ring == MAP_FAILED)
+		return -1;
+
+	r->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size,
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		munmap(r->ring, r->ring_size);
+		return -1;
+	}
+
+	ring = r->ring;
+	r->sq_head = (unsigned int *)(ring + params->sq_off.head);
+	r->sq_tail = (unsigned int *)(ring + params->sq_off.tail);
+	r->sq_array = (unsigned int *)(ring + params->sq_off.array);
+	r->sq_mask = *(unsigned int *)(ring + params->sq_off.ring_mask);
+	r->sq_entries = params->sq_entries;
+	r->sq_local_tail = *r->sq_tail;
+
+	r->cq_head = (unsigned int *)(ring + params->cq_off.head);
+	r->cq_tail = (unsigned int *)(ring + params->cq_off.tail);
+	r->cq_mask = *(unsigned int *)(ring + params->cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(ring + params->cq_off.cqes);
+
+	/* Submission slots are always used in order */
+	for (i = 0; i < r->sq_entries; i++)
+		r->sq_array[i] = i;
+	return 0;
+}
+
+/*
+ * Only zero-copy sends can take a registered buffer, so the quotes are
+ * only registered if those are available.
+ */
+static int supports_fixed_send(int fd)
+{
+	struct io_uring_probe *probe;
+	const size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	int ret;
+
+	probe = calloc(1, size);
+	if (!probe)
+		return 0;
+
+	ret = 0;
+	if (!io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) &&
+	    probe->last_op >= IORING_OP_SEND_ZC)
+		ret = !!(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	return ret;
+}
+
+struct uring *uring_create(int listen_fd, unsigned int timeout)
+{
+	struct io_uring_params params;
+	struct uring *r;
+
+	r = calloc(1, sizeof(struct uring));
+	if (unlikely(!r)) {
+		journal("Unable to allocate io_uring state: %s.\n", strerror(errno));
+		return NULL;
+	}
+
+	/* Each ring is only ever used by the worker that made it */
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	r->fd = io_uring_setup(URING_ENTRIES, &params);
+	if (r->fd < 0 && errno == EINVAL) {
+		memset(&params, 0, sizeof(params));
+		r->fd = io_uring_setup(URING_ENTRIES, &params);
+	}
+	if (r->fd < 0) {
+		journal("Unable to create io_uring: %s.\n", strerror(errno));
+		free(r);
+		return NULL;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		journal("This kernel's io_uring is too old to use.\n");
+		goto fail;
+	}
+	if (map_rings(r, &params)) {
+		journal("Unable to map io_uring: %s.\n", strerror(errno));
+		goto fail;
+	}
+
+	r->listen_fd = listen_fd;
+	r->timed = (timeout != 0);
+	r->timeout.tv_sec = timeout / 1000;
+	r->timeout.tv_nsec = (timeout % 1000) * 1000000;
+	r->multishot = 1;
+	r->skip_cqe = !!(params.features & IORING_FEAT_CQE_SKIP);
+	r->fixed = supports_fixed_send(r->fd);
+	return r;
+
+fail:
+	close(r->fd);
+	free(r);
+	return NULL;
+}
+
+static int submit(struct uring *r, unsigned int wait)
+{
+	ATOMIC_STORE(*r->sq_tail, r->sq_local_tail);
+	return io_uring_enter(r->fd,
+			      r->sq_local_tail - ATOMIC_LOAD(*r->sq_head),
+			      wait,
+			      wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/* Makes room for "count" more requests, submitting what's queued if need be */
+static int reserve_sqes(struct uring *r, unsigned int count)
+{
+	if (r->sq_local_tail + count - ATOMIC_LOAD(*r->sq_head) <= r->sq_entries)
+		return 0;
+
+	submit(r, 0);
+	return r->sq_local_tail + count - ATOMIC_LOAD(*r->sq_head) <= r->sq_entries ? 0 : -1;
+}
+
+/* Linked requests only need to be adjacent in the queue, so this may wrap */
+static struct io_uring_sqe *next_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = &r->sqes[r->sq_local_tail++ & r->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+static void arm_accept(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if (reserve_sqes(r, 1))
+		return;
+
+	sqe = next_sqe(r);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = r->listen_fd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->ioprio = r->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+	sqe->user_data = USER_DATA(OP_ACCEPT, 0, 0);
+	r->accepting = 1;
+}
+
+static void release_hold(struct uring *r, unsigned int slot)
+{
+	release_quotes(r->holds[slot].quotes);
+	r->holds[slot].quotes = NULL;
+}
+
+static int register_quotes(struct uring *r, const struct quote_data *qd)
+{
+	struct io_uring_rsrc_update2 update;
+	struct iovec iov;
+	const char *base;
+	size_t size;
+	int ret;
+
+	rendered_quotes(qd, &base, &size);
+	iov.iov_base = (void *)(uintptr_t)base;
+	iov.iov_len = size;
+
+	/* Sends already submitted keep the buffer they were given */
+	if (r->registered) {
+		memset(&update, 0, sizeof(update));
+		update.offset = 0;
+		update.data = (uint64_t)(uintptr_t)&iov;
+		update.nr = 1;
+		ret = io_uring_register(r->fd, IORING_REGISTER_BUFFERS_UPDATE,
+					&update, sizeof(update));
+	} else {
+		ret = io_uring_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+	}
+
+	if (ret < 0) {
+		journal("Unable to register quotes with io_uring, sending without: %s.\n",
+			strerror(errno));
+		return -1;
+	}
+	r->registered = 1;
+	return 0;
+}
+
+/*
+ * Makes sure the quotes being answered from are held, and registered
+ * as the ring's fixed buffer. Called at the start of each batch.
+ */
+static int track_quotes(struct uring *r)
+{
+	const struct quote_data *qd;
+	unsigned int slot, old;
+
+	qd = current_quotes();
+	if (likely(qd == r->holds[r->hold].quotes))
+		return 0;
+
+	for (slot = 0; slot < URING_HOLDS; slot++) {
+		if (!r->holds[slot].quotes)
+			break;
+	}
+	if (unlikely(slot == URING_HOLDS)) {
+		journal("Too many reloads with sends in flight.\n");
+		return -1;
+	}
+
+	old = r->hold;
+	r->holds[slot].quotes = hold_quotes();
+	r->holds[slot].inflight = 0;
+	r->hold = slot;
+	r->holds[slot].registered = r->fixed && !register_quotes(r, qd);
+
+	if (old != slot && r->holds[old].quotes && r->holds[old].inflight == 0)
+		release_hold(r, old);
+	return 0;
+}
+
+/*
+ * Queues a send of the quote, linked to closing the connection afterwards.
+ * The kernel times the send itself, so a timeout is linked in between
+ * which cancels it if the client doesn't read the quote in time.
+ */
+static void serve(struct uring *r, int consockfd, int usable)
+{
+	const int fixed = r->fixed && r->holds[r->hold].registered;
+	struct io_uring_sqe *send, *timeout, *shut;
+	const char *buffer;
+	size_t length;
+	uint32_t now;
+
+	now = clock_ms();
+	if (!usable ||
+	    !ratelimit_allow_socket(consockfd, now) ||
+	    !admission_admit(&r->admission, consockfd, now)) {
+		close(consockfd);
+		return;
+	}
+
+	if (get_quote_of_the_day(&buffer, &length) || unlikely(reserve_sqes(r, 2 + r->timed))) {
+		close(consockfd);
+		admission_release();
+		return;
+	}
+
+	/* A hard link closes the connection even if the send fails */
+	send = next_sqe(r);
+	send->opcode = fixed ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+	send->fd = consockfd;
+	send->addr = (uint64_t)(uintptr_t)buffer;
+	send->len = (uint32_t)length;
+	send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	send->flags = IOSQE_IO_HARDLINK;
+	send->user_data = USER_DATA(OP_SEND, r->hold, consockfd);
+	if (fixed) {
+		send->ioprio = IORING_RECVSEND_FIXED_BUF;
+		send->buf_index = 0;
+	}
+
+	if (r->timed) {
+		timeout = next_sqe(r);
+		timeout->opcode = IORING_OP_LINK_TIMEOUT;
+		timeout->addr = (uint64_t)(uintptr_t)&r->timeout;
+		timeout->len = 1;
+		timeout->flags = IOSQE_IO_HARDLINK;
+		timeout->user_data = USER_DATA(OP_TIMEOUT, 0, consockfd);
+	}
+
+	shut = next_sqe(r);
+	shut->opcode = IORING_OP_CLOSE;
+	shut->fd = consockfd;
+	shut->flags = r->skip_cqe ? IOSQE_CQE_SKIP_SUCCESS : 0;
+	shut->user_data = USER_DATA(OP_CLOSE, 0, consockfd);
+
+	r->holds[r->hold].inflight++;
+	r->inflight++;
+}
+
+static void handle_accept(struct uring *r, const struct io_uring_cqe *cqe, int usable)
+{
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		r->accepting = 0;
+	if (cqe->res >= 0) {
+		r->starved = 0;
+		serve(r, cqe->res, usable);
+		return;
+	}
+
+	switch (-cqe->res) {
+	case EINVAL:
+		if (r->multishot) {
+			/* Multishot accept is newer than the rest */
+			r->multishot = 0;
+			return;
+		}
+		break;
+	case EMFILE:
+	case ENFILE:
+		/* Wait for a connection to close before trying again */
+		if (!r->starved)
+			journal("Unable to accept connection: %s.\n", strerror(-cqe->res));
+		r->starved = 1;
+		return;
+	case EINTR:
+	case EAGAIN:
+	case ECONNABORTED:
+	case EPROTO:
+		return;
+	}
+	journal("Unable to accept connection: %s.\n", strerror(-cqe->res));
+}
+
+static void handle_send(struct uring *r, const struct io_uring_cqe *cqe)
+{
+	const unsigned int slot = USER_HOLD(cqe->user_data);
+
+	/* Zero-copy sends complete again once the kernel is done with the buffer */
+	if (cqe->flags & IORING_CQE_F_NOTIF)
+		goto done;
+
+	if (cqe->res == -EOPNOTSUPP && r->fixed) {
+		journal("Zero-copy sends aren't supported, sending without registered quotes.\n");
+		r->fixed = 0;
+	} else if (cqe->res < 0 && cqe->res != -ECANCELED && cqe->res != -EINTR) {
+		/* Anything else wasn't the client running out of time */
+		journal("Unable to write to TCP socket: %s.\n", strerror(-cqe->res));
+	}
+
+done:
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	r->inflight--;
+	r->starved = 0;
+	admission_release();
+	if (--r->holds[slot].inflight == 0 && slot != r->hold)
+		release_hold(r, slot);
+}
+
+/*
+ * Submits whatever has been queued and waits for something to happen,
+ * then handles every completion that is ready. Accepted connections have
+ * their send and close queued straight away, and are submitted along
+ * with the next wait.
+ */
+void uring_run(struct uring *r)
+{
+	struct io_uring_cqe cqe;
+	unsigned int head, tail;
+	int usable;
+
+	if (!r->accepting && !(r->starved && r->inflight))
+		arm_accept(r);
+
+	if (submit(r, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		const int errsave = errno;
+		JTRACE();
+		journal("Unable to wait for connections: %s.\n", strerror(errsave));
+		cleanup(EXIT_IO, 1);
+	}
+
+	quotes_online();
+	usable = !track_quotes(r);
+
+	head = *r->cq_head;
+	for (;;) {
+		tail = ATOMIC_LOAD(*r->cq_tail);
+		if (head == tail)
+			break;
+
+		for (; head != tail; head++) {
+			cqe = r->cqes[head & r->cq_mask];
+			ATOMIC_STORE(*r->cq_head, head + 1);
+
+			switch (USER_OP(cqe.user_data)) {
+			case OP_ACCEPT:
+				handle_accept(r, &cqe, usable);
+				break;
+			case OP_SEND:
+				handle_send(r, &cqe);
+				break;
+			}
+		}
+	}
+	quotes_offline();
+}
+
+#else
+
+struct uring *uring_create(int listen_fd, unsigned int timeout)
+{
+	UNUSED(listen_fd);
+	UNUSED(timeout);
+	journal("io_uring isn't supported here.\n");
+	errno = ENOSYS;
+	return NULL;
+}
+
+void uring_run(struct uring *ring)
+{
+	UNUSED(ring);
+}
+
+#endif /* __linux__ && IORING_ACCEPT_MULTISHOT ... */